@@ -0,0 +1,440 @@
+
+// LavaBench - micro-benchmarks for the data structures that LavaLoop threads share
+// Usage: LavaBench [queue] [alloc] [outq] [batch] [scratch]   - with no arguments every benchmark is run
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include "../../no_rt_util.h"
+#include "../../tbl.hpp"
+#include "../../simdb.hpp"
+
+#define __LAVAFLOW_IMPL__
+#include "../LavaFlow.hpp"
+
+namespace {
+
+using      clk  =  std::chrono::high_resolution_clock;
+using     au64  =  std::atomic<uint64_t>;
+using  thrdvec  =  std::vector<std::thread>;
+
+const u64  PKTS_PER_THREAD  =  1 << 18;
+const u64   PREFILL_PACKETS =  1 << 12;
+const u64 ALLOCS_PER_THREAD =  1 << 17;
+const u64       LIVE_ALLOCS =  256;                                      // blocks each thread keeps alive at once, like the packets a LavaLoop thread owns
+const u64      HANDOFF_SLOTS = 1024;
+const u64    OUTS_PER_THREAD =  1 << 16;
+const u64      RING_CAPACITY =  1 << 12;
+const u64      BATCH_PACKETS =  1 << 18;
+const u64        BATCH_BURST =  256;                                     // tiny packets a generator call makes, like one message per ray
+const u64       BATCH_WINDOW =  4;                                       // cycles in flight - the generator only runs on LavaLoop threads, so the window can be on
+const u64     SCRATCH_CALLS =  1 << 12;
+const u64      SCRATCH_TBLS =  8;                                       // temporary tbls built by one node call, like raysToIdxVerts in the tracer
+const u64    SCRATCH_PUSHES =  4096;
+
+using   AllocFn  =  void* (*)(size_t);
+using    FreeFn  =  void  (*)(void*);
+
+auto       threadCounts() -> std::vector<u64>
+{
+  std::vector<u64> ret;
+  u64 mx = std::max<u64>(std::thread::hardware_concurrency(), 1);
+  for(u64 n=1; n < mx; n *= 2){ ret.push_back(n); }
+  ret.push_back(mx);
+  return ret;
+}
+LavaPacket        makePacket(u64 i)
+{
+  LavaPacket p;
+  memset(&p, 0, sizeof(LavaPacket));
+  p.cycle     = i >> 6;                                                  // runs of packets share a cycle, like the outputs of a single generator pass
+  p.dest_node = i & 0xFF;
+  p.dest_slot = i & 0x3;
+  p.sz_bytes  = (i * 2654435761ull) & 0xFFFF;
+  p.id        = i;
+  return p;
+}
+f64       runQueueBench(LavaFlow::QType qt, u64 threads)                // returns packets per second through putPacket() + nxtPacket()
+{
+  using namespace std;
+
+  LavaFlow lf(qt);
+  TO(PREFILL_PACKETS,i){ lf.putPacket( makePacket(i) ); }               // keep the queue from running dry so that pops measure the queue and not an empty check
+
+  au64   go = 0;
+  thrdvec thrds;
+  TO(threads,t){
+    thrds.emplace_back([&lf,&go,t](){
+      LavaPacket pkt;
+      while(go.load()==0){ this_thread::yield(); }
+      u64 base = (t+1) * PKTS_PER_THREAD;
+      TO(PKTS_PER_THREAD,i){
+        lf.putPacket( makePacket(base + i) );
+        lf.nxtPacket(&pkt);
+      }
+    });
+  }
+
+  auto st = clk::now();
+    go.store(1);
+    for(auto& th : thrds){ th.join(); }
+  auto en = clk::now();
+
+  f64 secs = chrono::duration<f64>(en - st).count();
+  return (f64)(threads * PKTS_PER_THREAD) / secs;
+}
+void          queueBench()
+{
+  printf("\n packet queue - put + next packets per second \n");
+  printf(" %8s %16s %16s \n", "threads", "mutex queue", "multi queue");
+  for(auto n : threadCounts()){
+    f64 mtx = runQueueBench(LavaFlow::MUTEX_QUEUE, n);
+    f64 mlt = runQueueBench(LavaFlow::MULTI_QUEUE, n);
+    printf(" %8llu %16.0f %16.0f \n", (unsigned long long)n, mtx, mlt);
+  }
+}
+
+f64        runLavaQBench(u64 producers)                                 // returns outputs per second from one LavaQ per producer, which is what a node has to do today to push from several threads
+{
+  using namespace std;
+
+  using lavaQ = LavaQ<LavaOut>;
+  vector< atomic<lavaQ*> > qs(producers);
+  for(auto& q : qs){ q.store(nullptr); }
+
+  au64   go = 0;
+  thrdvec thrds;
+  TO(producers,t){
+    thrds.emplace_back([&,t](){
+      lavaQ q;                                                           // LavaQ is single producer, so each one has to be made on the thread that pushes into it
+      qs[t].store(&q);
+      while(go.load()==0){ this_thread::yield(); }
+      LavaOut o;
+      memset(&o, 0, sizeof(LavaOut));
+      TO(OUTS_PER_THREAD,i){
+        o.val.value = i;
+        q.push(o);
+      }
+      while(go.load()!=2){ this_thread::yield(); }                       // the consumer still reads from this queue until everything is popped
+    });
+  }
+  for(auto& q : qs){ while(q.load()==nullptr){ this_thread::yield(); } }
+
+  auto st = clk::now();
+    go.store(1);
+    u64 popped = 0;
+    LavaOut o;
+    while(popped < producers*OUTS_PER_THREAD){                           // the consumer has to visit every producer queue
+      for(auto& aq : qs){
+        lavaQ* q = aq.load();
+        if(q && q->pop(o)){ ++popped; }
+      }
+    }
+    go.store(2);
+    for(auto& th : thrds){ th.join(); }
+  auto en = clk::now();
+
+  f64 secs = chrono::duration<f64>(en - st).count();
+  return (f64)(producers * OUTS_PER_THREAD) / secs;
+}
+f64     runLavaRingQBench(u64 producers)                                 // returns outputs per second through a single LavaRingQ shared by every producer
+{
+  using namespace std;
+
+  LavaRingQ<LavaOut> q(RING_CAPACITY);
+
+  au64   go = 0;
+  thrdvec thrds;
+  TO(producers,t){
+    thrds.emplace_back([&](){
+      while(go.load()==0){ this_thread::yield(); }
+      LavaOut o;
+      memset(&o, 0, sizeof(LavaOut));
+      TO(OUTS_PER_THREAD,i){
+        o.val.value = i;
+        while( !q.push(o) ){ this_thread::yield(); }                     // full - give the consumer a chance to run
+      }
+    });
+  }
+
+  auto st = clk::now();
+    go.store(1);
+    u64 popped = 0;
+    LavaOut o;
+    while(popped < producers*OUTS_PER_THREAD){
+      if( q.pop(o) ){ ++popped; }
+      else{ this_thread::yield(); }
+    }
+    for(auto& th : thrds){ th.join(); }
+  auto en = clk::now();
+
+  f64 secs = chrono::duration<f64>(en - st).count();
+  return (f64)(producers * OUTS_PER_THREAD) / secs;
+}
+void           outqBench()
+{
+  printf("\n node output queue - producers pushing to one consumer, outputs per second \n");
+  printf(" %10s %20s %20s \n", "producers", "LavaQ per producer", "shared LavaRingQ");
+  for(u64 n=1; n<=32; n *= 2){
+    f64 lq = runLavaQBench(n);
+    f64 rq = runLavaRingQBench(n);
+    printf(" %10llu %20.0f %20.0f \n", (unsigned long long)n, lq, rq);
+  }
+}
+
+au64    batchMade, batchSeen, batchCalls;
+uint64_t        BurstGen(LavaParams const* lp, LavaFrame const* in, lava_threadQ* out)
+{
+  u64 c = batchMade.fetch_add(BATCH_BURST);
+  if(c >= BATCH_PACKETS){ return 0; }
+
+  TO(BATCH_BURST,i){
+    u64* m = (u64*)lp->ref_alloc(sizeof(u64));
+    *m     = c + i;
+    out->push( LavaOut(0, (u64)m) );
+  }
+  return 1;
+}
+uint64_t       CountPkts(LavaParams const* lp, LavaFrame const* in, lava_threadQ* out)
+{
+  u32 i=0, n=0;
+  while( LavaNxtPckt(in, &i) ){ ++n; }
+  batchSeen.fetch_add(n);
+  batchCalls.fetch_add(1);
+  return 1;
+}
+f64        runBatchBench(u64 batch, u64 threads, f64* out_avgBatch)     // returns tiny packets per second through one node with the given batch size
+{
+  using namespace std;
+
+  static const char*  types[] = {"u64", nullptr};
+  static const char*  names[] = {"x",   nullptr};
+
+  LavaNode gen = LavaNodeListEnd, cnt = LavaNodeListEnd;
+  gen.func       = BurstGen;
+  gen.node_type  = LavaNode::GENERATOR;
+  gen.name       = "BurstGen";
+  gen.out_types  = types;
+  gen.out_names  = names;
+  cnt.func       = CountPkts;
+  cnt.node_type  = LavaNode::FLOW;
+  cnt.name       = "CountPkts";
+  cnt.in_types   = types;
+  cnt.in_names   = names;
+  cnt.batch      = batch;
+
+  batchMade.store(0);
+  batchSeen.store(0);
+  batchCalls.store(0);
+
+  LavaFlow lf;
+  lf.defaultParams  = LavaParams();
+  lf.packetCallback = nullptr;
+  lf.cycles.window  = BATCH_WINDOW;
+  SECTION(generator output slot 0 connected to the counting node input slot 0)
+  {
+    LavaCommand::Arg A, B, S;
+    A.ndptr = &gen; B.val = 1; lf.graph.put(LavaCommand::ADD_NODE, A, B);
+    S.slotDest = false;        lf.graph.put(LavaCommand::ADD_SLOT, S);
+    A.ndptr = &cnt; B.val = 2; lf.graph.put(LavaCommand::ADD_NODE, A, B);
+    S.slotDest = true;         lf.graph.put(LavaCommand::ADD_SLOT, S);
+    lf.graph.exec();
+
+    LavaCommand::Arg dest, src;
+    dest.id = LavaId(2, 0, 1);
+    src.id  = LavaId(1, 0, 0);
+    lf.graph.put(LavaCommand::TGL_CNCT, dest, src);
+    lf.graph.exec();
+  }
+
+  lf.start();
+  thrdvec thrds;
+  auto st = clk::now();
+    TO(threads,t){ thrds.emplace_back([&lf](){ LavaLoop(lf); }); }
+    while(batchSeen.load() < BATCH_PACKETS){ this_thread::yield(); }
+  auto en = clk::now();
+  lf.stop();
+  for(auto& th : thrds){ th.join(); }
+
+  *out_avgBatch = (f64)batchSeen.load() / (f64)std::max<u64>(batchCalls.load(), 1);
+  f64 secs = chrono::duration<f64>(en - st).count();
+  return (f64)BATCH_PACKETS / secs;
+}
+void          batchBench()
+{
+  printf("\n batched node calls - tiny packets per second through one node \n");
+  printf(" %8s %16s %16s %12s \n", "threads", "one per call", "batch of 16", "avg batch");
+  for(auto n : threadCounts()){
+    f64 avg = 0;
+    f64 one = runBatchBench(0,                       n, &avg);
+    f64 bat = runBatchBench(LavaFrame::PACKET_SLOTS, n, &avg);
+    printf(" %8llu %16.0f %16.0f %12.2f \n", (unsigned long long)n, one, bat, avg);
+  }
+}
+
+u64         packetSize(u64 r)                                            // a mix of packet sizes from tbl headers and small messages up to multi-MB geometry
+{
+  u64 pct = r % 100;
+  r /= 100;
+  if(pct < 60) return  32 + r % 480;                                      // tbl headers, strings and small messages
+  if(pct < 90) return  1024 + r % (63*1024);                              // arrays of a few thousand elements
+  if(pct < 99) return  (64<<10) + r % (960<<10);                          // images and medium buffers
+               return  (1<<20) + r % (7<<20);                             // mesh geometry
+}
+u64              xorshift(u64& x)
+{
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
+}
+f64       runAllocBench(AllocFn alc, FreeFn fre, u64 threads, bool remote)  // returns allocations + frees per second - remote hands every other block to another thread to free
+{
+  using namespace std;
+
+  vector<atomic<void*>> handoff(HANDOFF_SLOTS);
+  for(auto& h : handoff){ h.store(nullptr); }
+
+  au64   go = 0;
+  thrdvec thrds;
+  TO(threads,t){
+    thrds.emplace_back([&,t](){
+      vector<void*> live(LIVE_ALLOCS, nullptr);
+      u64 rnd = 0x9E3779B97F4A7C15ull * (t+1);
+      while(go.load()==0){ this_thread::yield(); }
+
+      TO(ALLOCS_PER_THREAD,i){
+        u64   r = xorshift(rnd);
+        u64  sz = packetSize(r >> 8);
+        u8*   p = (u8*)alc(sz);
+        p[0]    = (u8)i;                                                  // touch both ends the way a node filling in a tbl would
+        p[sz-1] = (u8)i;
+
+        void*& slot = live[r % LIVE_ALLOCS];
+        void*   old = slot;
+        slot        = p;
+        if(!old){ continue; }
+
+        if(remote && (r & 0x10)){ old = handoff[(r>>20) % HANDOFF_SLOTS].exchange(old); }  // swap with a block another thread put in, so this thread frees memory it did not allocate
+        if(old){ fre(old); }
+      }
+      for(auto p : live){ if(p) fre(p); }
+    });
+  }
+
+  auto st = clk::now();
+    go.store(1);
+    for(auto& th : thrds){ th.join(); }
+  auto en = clk::now();
+
+  for(auto& h : handoff){ void* p = h.exchange(nullptr); if(p) fre(p); }
+
+  f64 secs = chrono::duration<f64>(en - st).count();
+  return (f64)(threads * ALLOCS_PER_THREAD * 2) / secs;
+}
+void*         mallocFn(size_t sz){ return malloc(sz); }
+void            freeFn(void* p){ free(p); }
+void*           lavaFn(size_t sz){ return LavaHeapAlloc(sz); }
+void        lavaFreeFn(void* p){ LavaHeapFree(p); }
+f64     runScratchBench(bool arena, u64 threads)                      // returns node calls per second, each building SCRATCH_TBLS local tbls element by element
+{
+  using namespace std;
+
+  au64   go = 0;
+  thrdvec thrds;
+  TO(threads,t){
+    thrds.emplace_back([&,arena](){
+      LavaScratch scratch;
+      LavaParams lp = LavaParams();
+      if(arena){
+        lava_thread_scratch = &scratch;
+        lp.local_alloc      = LavaScratchAlloc;
+        lp.local_realloc    = LavaScratchReAlloc;
+        lp.local_free       = LavaScratchFree;
+      }else{
+        lp.local_alloc      = malloc;
+        lp.local_realloc    = realloc;
+        lp.local_free       = free;
+      }
+      while(go.load()==0){ this_thread::yield(); }
+
+      TO(SCRATCH_CALLS,c){
+        f32 sum = 0;
+        SECTION(node call)
+        {
+          tbl tbls[SCRATCH_TBLS];
+          TO(SCRATCH_TBLS,i){
+            tbls[i] = LavaLocalTbl(&lp);
+            tbls[i].setArrayType<f32>();
+          }
+          TO(SCRATCH_PUSHES,j) TO(SCRATCH_TBLS,i){ tbls[i].push( (f32)(i+j) ); }
+          TO(SCRATCH_TBLS,i){ sum += tbls[i].data<f32>()[SCRATCH_PUSHES-1]; }
+        }
+        if(sum < 0){ printf("%f", sum); }                               // keeps the tbls from being optimized away
+        scratch.reset();
+      }
+      lava_thread_scratch = nullptr;
+    });
+  }
+
+  auto st = clk::now();
+    go.store(1);
+    for(auto& th : thrds){ th.join(); }
+  auto en = clk::now();
+
+  f64 secs = chrono::duration<f64>(en - st).count();
+  return (f64)(threads * SCRATCH_CALLS) / secs;
+}
+void        scratchBench()
+{
+  printf("\n node local tbls - calls per second building %llu tbls of %llu pushes each \n", (unsigned long long)SCRATCH_TBLS, (unsigned long long)SCRATCH_PUSHES);
+  printf(" %8s %16s %16s \n", "threads", "malloc", "LavaScratch");
+  for(auto n : threadCounts()){
+    f64 mlc = runScratchBench(false, n);
+    f64 arn = runScratchBench(true,  n);
+    printf(" %8llu %16.0f %16.0f \n", (unsigned long long)n, mlc, arn);
+  }
+}
+void          allocBench()
+{
+  printf("\n packet memory - allocations + frees per second \n");
+  printf(" %8s %16s %16s %18s %18s \n", "threads", "malloc", "LavaHeapAlloc", "malloc remote", "LavaHeap remote");
+  for(auto n : threadCounts()){
+    f64 mlc  = runAllocBench(mallocFn, freeFn,     n, false);
+    f64 lava = runAllocBench(lavaFn,   lavaFreeFn, n, false);
+    f64 mlcR = runAllocBench(mallocFn, freeFn,     n, true);
+    #if defined(_WIN32)
+      printf(" %8llu %16.0f %16.0f %18.0f %18s \n", (unsigned long long)n, mlc, lava, mlcR, "n/a");  // Win32 thread heaps are made with HEAP_NO_SERIALIZE and can't be freed from another thread
+    #else
+      f64 lavaR = runAllocBench(lavaFn, lavaFreeFn, n, true);
+      printf(" %8llu %16.0f %16.0f %18.0f %18.0f \n", (unsigned long long)n, mlc, lava, mlcR, lavaR);
+    #endif
+  }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  bool all = argc < 2;
+  for(int i=1; i<argc; ++i){
+    if( strcmp(argv[i],"queue")==0 ) queueBench();
+    if( strcmp(argv[i],"alloc")==0 ) allocBench();
+    if( strcmp(argv[i],"outq")==0 )  outqBench();
+    if( strcmp(argv[i],"batch")==0 ) batchBench();
+    if( strcmp(argv[i],"scratch")==0 ) scratchBench();
+  }
+  if(all){
+    queueBench();
+    allocBench();
+    outqBench();
+    batchBench();
+    scratchBench();
+  }
+
+  return 0;
+}
@@ -58,9 +58,11 @@
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <array>
 #include <string>
 #include <queue>
+#include <deque>
 #include <stack>
 #include <unordered_map>
 #include <unordered_set>
@@ -79,9 +81,19 @@
   #include <Windows.h>
 #elif defined(__APPLE__) || defined(__MACH__) || defined(__unix__) || defined(__FreeBSD__) // || defined(__linux__) ?    // osx, linux and freebsd
   #include <unistd.h>
+  #include <fcntl.h>
+  #include <sys/stat.h>
+  #include <sys/mman.h>
+  #include <dlfcn.h>
+  #include <signal.h>
+  #include <setjmp.h>
+  #if defined(__linux__)
+    #include <sys/inotify.h>
+  #endif
 #endif
 
 #define LAVA_ARG_COUNT 512
+#define LAVA_MAX_THREADS 64                                           // the number of per-thread packet deques a LavaFlow has for LOCAL_FIRST scheduling
 
 #if defined(_MSC_VER)
   //namespace fs = std::tr2::sys;                                                             // todo: different compiler versions would need different filesystem paths
@@ -401,6 +413,128 @@ template<class T> struct LavaQ
   }
 };
 
+template<class T> struct LavaRingQ
+{
+// bounded multi-producer, multi-consumer queue
+// Design: A fixed power of 2 ring of cells, each with its own sequence number, and two 64 bit atomic counters for the start and end that only increment
+// A producer claims position m_end when its cell sequence equals the position, writes the value, then sets the sequence to position+1 to hand it to consumers
+// A consumer claims position m_st when its cell sequence equals position+1, reads the value, then sets the sequence to position+capacity to hand it back to producers
+// There is no reallocation, so the ring can be shared by any number of threads - push() returns false when the ring is full instead of growing
+// Like LavaQ, two function pointers contain the allocation and deallocation functions to use so that the data structure can cross a shared library boundary
+
+  using       u64 = uint64_t;
+  using      au64 = std::atomic<u64>;
+  using AllocFunc = void*(*)(size_t);
+  using  FreeFunc = void(*)(void*);
+
+  struct Cell { au64 seq; T val; };
+
+  AllocFunc          m_alloc = nullptr;
+  FreeFunc            m_free = nullptr;
+  Cell*              m_cells = nullptr;
+  u64                 m_mask = 0;
+  alignas(64) au64     m_end;                                      // producers and consumers are on separate cache lines so pushes and pops don't invalidate each other
+  alignas(64) au64      m_st;
+
+  void init(u64 capacity)
+  {
+    u64 cap = 2;
+    while(cap < capacity){ cap <<= 1; }                            // round up to a power of 2 so the index is a mask instead of a modulo
+    m_mask  = cap - 1;
+    m_cells = (Cell*)m_alloc( cap * sizeof(Cell) );
+    TO(cap,i){
+      new (&m_cells[i].seq) au64(i);
+      new (&m_cells[i].val) T();
+    }
+    m_end.store(0);
+    m_st.store(0);
+  }
+
+  LavaRingQ(u64 capacity=1024) : 
+    m_alloc( malloc ),
+    m_free( free )
+  {
+    init(capacity);
+  }
+  LavaRingQ(u64 capacity, AllocFunc a, FreeFunc f) : m_alloc(a), m_free(f)
+  {
+    init(capacity);
+  }
+  ~LavaRingQ()
+  {
+    if(m_cells){
+      TO(capacity(),i){ m_cells[i].val.~T(); }
+      m_free(m_cells);
+    }
+  }
+
+  LavaRingQ(LavaRingQ const&)      = delete;
+  void operator=(LavaRingQ const&) = delete;
+
+  bool             push(T const& val)
+  {
+    u64 pos = m_end.load(std::memory_order_relaxed);
+    for(;;){
+      Cell&  c = m_cells[pos & m_mask];
+      u64  seq = c.seq.load(std::memory_order_acquire);
+      i64 diff = (i64)seq - (i64)pos;
+      if(diff == 0){
+        if( m_end.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed) ){
+          c.val = val;
+          c.seq.store(pos+1, std::memory_order_release);
+          return true;
+        }                                                          // a failed compare exchange reloads pos
+      }else if(diff < 0){
+        return false;                                              // the cell still holds a value from a lap ago, so the ring is full
+      }else{
+        pos = m_end.load(std::memory_order_relaxed);               // another producer claimed this position
+      }
+    }
+  }
+  bool              pop(T& ret)
+  {
+    u64 pos = m_st.load(std::memory_order_relaxed);
+    for(;;){
+      Cell&  c = m_cells[pos & m_mask];
+      u64  seq = c.seq.load(std::memory_order_acquire);
+      i64 diff = (i64)seq - (i64)(pos+1);
+      if(diff == 0){
+        if( m_st.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed) ){
+          ret = c.val;
+          c.seq.store(pos + m_mask + 1, std::memory_order_release);
+          return true;
+        }
+      }else if(diff < 0){
+        return false;                                              // the producer for this position has not finished writing, so the ring is empty up to here
+      }else{
+        pos = m_st.load(std::memory_order_relaxed);
+      }
+    }
+  }
+  template<class Q> u64 drain(Q* q)                                // pops everything into another queue - a node that pushes from its own worker threads can drain into its lava_threadQ before returning
+  {
+    u64 cnt = 0;
+    T   val;
+    while( pop(val) ){ q->push(val); ++cnt; }
+    return cnt;
+  }
+  void            clear()
+  {
+    T val;
+    while( pop(val) ){}
+  }
+  u64              size()          const                           // only exact when no other thread is pushing or popping
+  {
+    u64 en = m_end.load();
+    u64 st = m_st.load();
+    return en > st?  en - st  :  0;
+  }
+  u64          capacity()          const
+  {
+    return m_mask + 1;
+  }
+};
+
 static inline u64 popcount64(u64 x)
 {
   /*
@@ -449,10 +583,25 @@ static inline u64 popcount64(u64 x)
   // End libpopcnt
 }
 
+static inline u64      msb64(u64 x)                        // index of the highest set bit - x must not be 0
+{
+#if defined(_MSC_VER)
+  unsigned long r = 0;
+  _BitScanReverse64(&r, x);
+  return r;
+#else
+  return 63 - __builtin_clzll(x);
+#endif
+}
+
 // static data segment data
 #if defined(_WIN32)
   //static const std::string  liveExt(".live.dll");                            // todo: change this to const char* - don't want static intialization functions running
   static const char* liveExt = ".live.dll";                                    // todo: change this to const char* - don't want static intialization functions running
+  static const char*  libExt = ".dll";
+#else
+  static const char* liveExt = ".live.so";
+  static const char*  libExt = ".so";
 #endif
 
 //static __declspec(thread)       void*   lava_thread_heap = nullptr;          // thread local handle for thread local heap allocations
@@ -467,6 +616,7 @@ BOOL WINAPI DllMain(
 );
 
 // allocator definitions
+#if defined(_WIN32)
 inline void    LavaHeapDestroyCallback(void* heapHnd)
 {
   if(heapHnd)
@@ -511,6 +661,200 @@ inline void       LavaHeapFree(void* memptr)
     //return ret;
   }//else{ return 0; }
 }
+#else
+struct   LavaSlabHeap
+{
+// per thread size class allocator behind LavaHeapAlloc where there are no Win32 heaps
+// Design: every block starts with a 16 byte header holding the heap that made it and its size class, so a free never needs a lookup
+// Blocks up to SMALL_MAX are carved from SPAN_BYTES spans of pages, larger blocks get their own pages - both are kept on per class free lists when freed instead of going back to the OS or malloc
+// Only the owning thread touches the free lists - a block freed on another thread is pushed onto the owner's lock free m_remote stack and the owner moves those to its free lists when a list it needs is empty
+// A heap is never destroyed, when its thread exits it is put in an orphan pool and taken over by the next new thread, so blocks still in flight always have a live owner
+
+  using        u8 = uint8_t;
+  using       u64 = uint64_t;
+  using      au64 = std::atomic<uint64_t>;
+
+  struct    Block
+  {
+    Block*     nxt;                                                      // written over the owner pointer while the block is free
+    u64        cls;
+  };
+  using    ABlock = std::atomic<Block*>;
+
+  static const u64        HDR = 16;
+  static const u64    CLASSES = 176;                                     // 16 linear classes up to 256 bytes then 4 classes per power of two up to 2^48
+  static const u64  SMALL_MAX = 1 << 16;
+  static const u64 SPAN_BYTES = 1 << 20;
+  static const u64 LARGE_KEEP = 256ull << 20;                            // bytes of freed large blocks a heap keeps before giving pages back to the OS
+
+  std::array<Block*, CLASSES>  m_free;
+  ABlock            m_remote;
+  u8*              m_spanCur = nullptr;
+  u8*              m_spanEnd = nullptr;
+  u64            m_largeKept = 0;
+  au64           remoteFrees = 0;                                        // blocks that came back through m_remote
+
+  LavaSlabHeap() : m_remote(nullptr) { m_free.fill(nullptr); }
+
+  static u64    sizeClass(u64 sz)                                        // sz includes the header
+  {
+    if(sz <= 256){ return sz? (sz+15)/16 - 1 : 0; }
+
+    u64    v = sz - 1;
+    u64    e = msb64(v);
+    u64 mant = (v >> (e-2)) & 3;
+    return 16 + (e-8)*4 + mant;
+  }
+  static u64    classSize(u64 c)
+  {
+    if(c < 16){ return (c+1)*16; }
+
+    u64    e = (c-16)/4 + 8;
+    u64 mant = (c-16)%4;
+    return (4 + mant + 1) << (e-2);
+  }
+  static void*      pages(u64 sz)
+  {
+    void* p = mmap(nullptr, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    return p==MAP_FAILED?  nullptr  :  p;
+  }
+
+  void         pushFree(Block* b)                                        // owner only
+  {
+    u64 csz = classSize(b->cls);
+    if(csz > SMALL_MAX){
+      if(m_largeKept + csz > LARGE_KEEP){ munmap(b, csz); return; }
+      m_largeKept += csz;
+    }
+    b->nxt         = m_free[b->cls];
+    m_free[b->cls] = b;
+  }
+  void      drainRemote()                                                // owner only
+  {
+    Block* b = m_remote.exchange(nullptr, std::memory_order_acquire);
+    while(b){
+      Block* nxt = b->nxt;
+      pushFree(b);
+      b = nxt;
+      remoteFrees.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  void       remoteFree(Block* b)                                        // any thread
+  {
+    Block* head = m_remote.load(std::memory_order_relaxed);
+    do{
+      b->nxt = head;
+    }while( !m_remote.compare_exchange_weak(head, b, std::memory_order_release, std::memory_order_relaxed) );
+  }
+  Block*          carve(u64 c)
+  {
+    u64 csz = classSize(c);
+    if(csz > SMALL_MAX){ return (Block*)pages(csz); }
+
+    if(m_spanCur + csz > m_spanEnd){                                      // whatever is left of the current span is too small and is abandoned
+      u8* span = (u8*)pages(SPAN_BYTES);
+      if(!span){ return nullptr; }
+      m_spanCur = span;
+      m_spanEnd = span + SPAN_BYTES;
+    }
+    Block* b   = (Block*)m_spanCur;
+    m_spanCur += csz;
+    return b;
+  }
+  void*           alloc(u64 sz)                                          // owner only
+  {
+    u64 c = sizeClass(sz + HDR);
+    if(c >= CLASSES){ return nullptr; }
+
+    if(!m_free[c]){ drainRemote(); }
+    if(!m_free[c] && classSize(c) > SMALL_MAX){                          // a large block up to 4 classes bigger is better than new pages, which have to be mapped and faulted in
+      for(u64 up=c+1; up<CLASSES && up<=c+4; ++up){
+        if(m_free[up]){ c = up; break; }
+      }
+    }
+
+    Block* b = m_free[c];
+    if(b){
+      m_free[c] = b->nxt;
+      u64 csz   = classSize(c);
+      if(csz > SMALL_MAX){ m_largeKept -= csz; }
+    }else{
+      b = carve(c);
+      if(!b){ return nullptr; }
+    }
+
+    *((LavaSlabHeap**)b) = this;
+    b->cls               = c;
+    return (u8*)b + HDR;
+  }
+  static void   release(void* p, LavaSlabHeap* cur)                      // cur is the calling thread's heap, which can be null
+  {
+    Block*           b = (Block*)((u8*)p - HDR);
+    LavaSlabHeap* ownr = *((LavaSlabHeap**)b);
+    if(ownr == cur) cur->pushFree(b);
+    else           ownr->remoteFree(b);
+  }
+  static u64       usable(void* p)                                       // the number of bytes the block at p can hold
+  {
+    Block* b = (Block*)((u8*)p - HDR);
+    return classSize(b->cls) - HDR;
+  }
+
+  static std::mutex&            orphanLck(){ static std::mutex m;                  return m; }
+  static std::vector<LavaSlabHeap*>& orphans(){ static std::vector<LavaSlabHeap*> v; return v; }
+  static LavaSlabHeap*          adopt()
+  {
+    std::lock_guard<std::mutex> lck(orphanLck());
+    auto& o = orphans();
+    if(o.size() == 0){ return new LavaSlabHeap(); }
+
+    LavaSlabHeap* h = o.back();
+    o.pop_back();
+    return h;
+  }
+  static void                 orphan(LavaSlabHeap* h)
+  {
+    std::lock_guard<std::mutex> lck(orphanLck());
+    orphans().push_back(h);
+  }
+};
+struct  LavaSlabOwner                                                    // gives the thread's heap to the orphan pool when the thread exits
+{
+  LavaSlabHeap* heap = nullptr;
+  ~LavaSlabOwner(){ if(heap){ LavaSlabHeap::orphan(heap); } }
+};
+thread_local LavaSlabOwner  lava_thread_slabOwner;
+
+inline void    LavaHeapDestroyCallback(void* heapHnd)
+{
+  if(heapHnd)
+    LavaSlabHeap::orphan( (LavaSlabHeap*)heapHnd );
+}
+inline void*      LavaHeapInit(size_t initialSz = 0)
+{
+  if(!lava_thread_heap) {
+    lava_thread_heap            = LavaSlabHeap::adopt();
+    lava_thread_slabOwner.heap  = (LavaSlabHeap*)lava_thread_heap;
+  }
+  return lava_thread_heap;
+}
+inline void*     LavaHeapAlloc(size_t sz)
+{
+  LavaSlabHeap* thread_heap = (LavaSlabHeap*)LavaHeapInit(sz);
+  return thread_heap->alloc(sz);
+}
+inline void*   LavaHeapReAlloc(void* memptr, size_t sz)
+{
+  if(!memptr){ return LavaHeapAlloc(sz); }
+
+  return sz <= LavaSlabHeap::usable(memptr)?  memptr  :  nullptr;          // in place only, like the Win32 version
+}
+inline void       LavaHeapFree(void* memptr)
+{
+  if(memptr)
+    LavaSlabHeap::release(memptr, (LavaSlabHeap*)lava_thread_heap);
+}
+#endif
 
 template <class T> struct  ThreadAllocator
 {
@@ -566,6 +910,115 @@ template <class T> void    ThreadAllocator<T>::deallocate(T* const& p, size_t) c
 {
   LavaHeapFree(p);
 }
+struct   LavaScratch
+{
+// per thread bump arena behind LavaParams::local_alloc - LavaLoop resets it after every iteration, so the temporary tbls a node builds in a call cost a pointer bump instead of a heap allocation and a realloc chain
+// Design: blocks are cut one after another from chunks that are kept from one reset to the next, each with a 16 byte header holding its size and a check word, so realloc of the most recent block can grow in place and a copy knows how much to move
+// freeLast only gives back the most recent block, so an alloc and free loop reuses the same bytes - any other block lives until reset
+// A local tbl's destructor can run before the LavaOut made from it is routed, so LavaScratchFree promotes the outputs of the call before the freed bytes can be cut again, the same copy LavaScratchPromote makes after the call
+
+  using   u8 = uint8_t;
+  using  u64 = uint64_t;
+
+  static const u64         HDR = 16;
+  static const u64 CHUNK_BYTES = 1 << 20;
+  static const u64  KEEP_BYTES = 64ull << 20;                            // bytes of chunks kept past a reset - a call that needed more gives the rest back
+  static const u64       CHECK = 0x4C617661536372ull;                    // xor'd with the block address, so a pointer that is not the start of a block is not mistaken for one
+
+  struct Chunk
+  {
+    u8*    mem;
+    u64    cap;
+  };
+
+  std::vector<Chunk>  m_chunks;
+  u64                    m_cur = 0;                                      // the chunk blocks are being cut from
+  u64                   m_used = 0;                                      // bytes of the current chunk already cut
+  u8*                   m_last = nullptr;                                // the most recent block, the only one that can grow in place
+
+  LavaScratch(){}
+  LavaScratch(LavaScratch const&) = delete;
+  LavaScratch& operator=(LavaScratch const&) = delete;
+  ~LavaScratch(){ for(auto& c : m_chunks){ free(c.mem); } }
+
+  static u64      round(u64 sz){ return (sz + 15) & ~15ull; }
+  static u64*    header(void* p){ return (u64*)((u8*)p - HDR); }
+  static u64       size(void* p){ return header(p)[0]; }
+
+  bool            owns(void* p) const
+  {
+    for(auto const& c : m_chunks){
+      if((u8*)p >= c.mem && (u8*)p < c.mem+c.cap){ return true; }
+    }
+    return false;
+  }
+  bool         isBlock(void* p) const                                    // true if p is the start of a block cut since the last reset
+  {
+    return owns(p) && header(p)[1] == (CHECK ^ (u64)p);
+  }
+  void*          alloc(u64 sz)
+  {
+    u64 need = HDR + round(sz);
+    while(m_cur < m_chunks.size() && m_used+need > m_chunks[m_cur].cap){ ++m_cur; m_used = 0; }   // a chunk too small for this block is skipped until the next reset
+    if(m_cur == m_chunks.size()){
+      u64 cap = need > CHUNK_BYTES?  need  :  CHUNK_BYTES;
+      u8* mem = (u8*)malloc(cap);
+      if(!mem){ return nullptr; }
+      m_chunks.push_back({mem, cap});
+      m_used = 0;
+    }
+
+    u8*  blk = m_chunks[m_cur].mem + m_used;
+    u8*    p = blk + HDR;
+    ((u64*)blk)[0] = sz;
+    ((u64*)blk)[1] = CHECK ^ (u64)p;
+    m_used += need;
+    m_last  = p;
+    return p;
+  }
+  void*        realloc(void* p, u64 sz)
+  {
+    if(!p){ return alloc(sz); }
+
+    u64 prevSz = size(p);
+    if(p == m_last){                                                     // the top of the current chunk, so it can move the end of the chunk
+      Chunk& c = m_chunks[m_cur];
+      u64  ofst = (u8*)p - c.mem;
+      if(ofst + round(sz) <= c.cap){
+        header(p)[0] = sz;
+        m_used       = ofst + round(sz);
+        return p;
+      }
+    }else if(sz <= prevSz){
+      header(p)[0] = sz;
+      return p;
+    }
+
+    void* nxt = alloc(sz);
+    if(nxt){ memcpy(nxt, p, std::min(prevSz, sz)); }
+    return nxt;
+  }
+  bool        freeLast(void* p)                                          // returns true if p was the most recent block and its bytes can be cut again
+  {
+    if(!p || p != m_last){ return false; }
+
+    header(p)[1] = 0;                                                    // no longer a block, so a stale output pointing at it is not copied
+    m_used       = (u8*)p - HDR - m_chunks[m_cur].mem;
+    m_last       = nullptr;                                              // the block under it can not grow in place, since its end is not known
+    return true;
+  }
+  void           reset()
+  {
+    u64 kept = 0, keep = 0;
+    for(; keep < m_chunks.size() && kept+m_chunks[keep].cap <= KEEP_BYTES; ++keep){ kept += m_chunks[keep].cap; }
+    for(u64 i=std::max<u64>(keep,1); i < m_chunks.size(); ++i){ free(m_chunks[i].mem); }
+    if(m_chunks.size() > 1){ m_chunks.resize( std::max<u64>(keep,1) ); }
+
+    m_cur  = 0;
+    m_used = 0;
+    m_last = nullptr;
+  }
+};
 // end allocator definitions
 
 // data types
@@ -584,7 +1037,11 @@ enum class LavaControl { STOP=0, GO=1 };
 
 using str                =  std::string;
 using wstr               =  std::wstring;
+#if defined(_WIN32)
 using lava_handle        =  HMODULE;                                                      // maps handles to the LavaFlowNode pointers contained in the shared libraries
+#else
+using lava_handle        =  void*;                                                        // the handle dlopen returns
+#endif
 using lava_paths         =  std::vector<std::string>;
 using lava_hndlNodeMap   =  std::unordered_multimap<lava_handle, LavaNode*>;              // maps handles to the LavaFlowNode pointers contained in the shared libraries
 using lava_lstNodesMap   =  std::unordered_multimap<LavaNode*, LavaNode*>;                // maps each node to its starting node list pointer
@@ -597,6 +1054,7 @@ using lava_flowPtrs      =  std::unordered_set<LavaNode*>;
 using lava_ptrsvec       =  std::vector<LavaNode*>;
 using lava_nameNodeMap   =  std::unordered_map<std::string, LavaNode*>;                   // maps the node names to their pointers
 using lava_threadQ       =  LavaQ<LavaOut>;
+using lava_mpmcQ         =  LavaRingQ<LavaOut>;                                           // for nodes that push outputs from several threads of their own, then drain them into their lava_threadQ
 
 extern "C" using       LavaAllocFunc  =  void* (*)(uint64_t);                             // custom allocation function passed in to each node call
 extern "C" using     LavaReallocFunc  =  void* (*)(void*, uint64_t);                      // custom allocation function passed in to each node call
@@ -604,6 +1062,8 @@ extern "C" using        LavaFreeFunc  =  void  (*)(void*);
 extern "C" using  GetLavaFlowNodes_t  =  LavaNode*(*)();                                               // the signature of the function that is searched for in every shared library - this returns a LavaFlowNode* that is treated as a sort of null terminated list of the actual nodes contained in the shared library 
 extern "C" using            FlowFunc  =  uint64_t (*)(LavaParams const*, LavaFrame const*, lava_threadQ*);   // node function taking a LavaFrame in
 extern "C" using       ConstructFunc  =  void(*)();
+extern "C" using           SplitFunc  =  uint64_t (*)(LavaParams const*, LavaFrame const*);                                // returns how many items the input of a splittable node holds
+extern "C" using          GatherFunc  =  uint64_t (*)(LavaParams const*, uint32_t slot, LavaVal const* parts, uint64_t count, lava_threadQ*);   // joins the outputs of the ranges of a split packet for one output slot
 //extern "C" using      PacketCallback  =  LavaControl (*)();
 extern "C" using      PacketCallback  =  LavaControl (*)(LavaPacket* pkt);
 
@@ -658,6 +1118,18 @@ struct   AtomicBitset
     u64    bits = abits->load();
     return (bool) ((bits >> bit) & 0x1);
   }
+  bool     trySet(u64 bit)                                              // sets the bit and returns true only if this call was the one that changed it from 0 to 1
+  {
+    u64 prevBits, nxtBits;
+    au64*  abits = (au64*)(&bits);
+    do{
+      prevBits = nxtBits = abits->load();
+      if( (prevBits >> bit) & 0x1 ){ return false; }
+      nxtBits |= (u64)0x1 << bit;
+    }while( !abits->compare_exchange_strong(prevBits, nxtBits) );
+
+    return true;
+  }
   u8        count()        const  // make x an atomic load
   {
     auto x = bits;
@@ -745,6 +1217,9 @@ struct        LavaOut
     u8 bytes[16];
   }key;
 
+  u64  priority = 0;           // 0 to 255 - higher runs sooner, and the packets made from this output keep the highest priority of it and the inputs of the call
+  u64  deadline = 0;           // nanoseconds from now that the packets made from this output should run within - 0 keeps the earliest deadline of the inputs, if any
+
   LavaOut() : key{0,0,0}, val{0,0} {}
   LavaOut(u32 slot, u64 value) : key{0,slot,0}, val{LavaArgType::MEMORY,value}
   {}
@@ -769,7 +1244,9 @@ struct     LavaPacket
   u64     rangeEnd;
   u64     sz_bytes;                               // the size in bytes can be used to further sort the packets so that the largets are processed first, possibly resulting in less memory usage over time
   u64           id;
+  u64     deadline = 0;                           // LavaProfiler::nowNs() time the packet should run by - 0 is no deadline
   LavaVal      val;
+  u64        split;                               // the LavaSplit record this range of a split packet reports its outputs to - 0 when the packet is not a range
   //LavaMsg      msg;
 
   bool operator<(LavaPacket const& r) const
@@ -782,33 +1259,127 @@ struct     LavaPacket
     return id > r.id;
   }
 };
+struct  LavaPacketOrder
+{
+// the order the packet queues run packets in, chosen when the LavaFlow is made
+// CYCLE_FIRST is LavaPacket::operator< - the oldest cycle first and priority only within a cycle, so a cycle is never held up by a newer one
+// PRIORITY_FIRST runs higher priority packets ahead of every lower priority packet, whatever their cycles
+// DEADLINE_FIRST runs packets with a deadline first, earliest deadline first, then by priority - packets without a deadline keep the CYCLE_FIRST order after them
+
+  enum   Mode { CYCLE_FIRST=0, PRIORITY_FIRST, DEADLINE_FIRST };
+
+  static const u64 NO_DEADLINE = 0xFFFFFFFFFFFFFFFE;                     // one below LavaMultiQ::EMPTY_RANK so a heap of packets without deadlines still looks full
+
+  Mode mode = CYCLE_FIRST;
+
+  LavaPacketOrder(Mode m = CYCLE_FIRST) : mode(m) {}
+
+  static u64 deadlineOf(LavaPacket const& p){ return p.deadline? std::min<u64>(p.deadline, NO_DEADLINE-1) : NO_DEADLINE; }
+
+  bool operator()(LavaPacket const& a, LavaPacket const& b) const        // true if a runs after b, the same as std::less for std::priority_queue
+  {
+    if(mode == DEADLINE_FIRST){
+      u64 da = deadlineOf(a), db = deadlineOf(b);
+      if(da != db) return da > db;
+    }
+    if(mode != CYCLE_FIRST && a.priority != b.priority){ return a.priority < b.priority; }
+    return a < b;
+  }
+  u64            rank(LavaPacket const& p) const                         // lower runs first - only what LavaMultiQ needs to choose between two heaps by their tops
+  {
+    switch(mode){
+      case PRIORITY_FIRST: return ((u64)(255 - p.priority) << 55) | p.cycle;
+      case DEADLINE_FIRST: return deadlineOf(p);
+      case CYCLE_FIRST:
+      default:             return p.cycle;
+    }
+  }
+};
+struct  LavaFramePacket
+{
+// the packed copy of a packet that a frame gives its node - 32 bytes instead of the 88 of a LavaPacket, so a frame is a cache line or two to build and copy
+// Design: it keeps only what a node reads - the value and its size, where it came from and the range of a split packet - under the same names as LavaPacket, so node code reading in->packets[i].val or .sz_bytes does not change
+// What the queues need to schedule a packet - cycle, destination, priority and deadline - is kept once in the frame, and the LavaSplit record stays with the queue packet the loop holds
+
+  LavaVal          val;
+  u64         sz_bytes : 48;
+  u64        dest_slot : 16;                       // the input slot of the node, which is not the frame slot for a batch
+  u64         src_node : 47;
+  u64            split :  1;                       // 1 if this is a range of a split packet
+  u64         src_slot : 16;
+  u32       rangeStart;                            // items of the whole input - LavaSplitPacket does not split inputs of more than 2^32 items
+  u32         rangeEnd;
+
+  LavaFramePacket(){}                              // left uninitialized, so a frame does not write every slot when it is made
+  LavaFramePacket(LavaPacket const& p) :
+    val(p.val), sz_bytes(p.sz_bytes), dest_slot(p.dest_slot), src_node(p.src_node), split(p.split!=0), src_slot(p.src_slot),
+    rangeStart((u32)p.rangeStart), rangeEnd((u32)p.rangeEnd) {}
+};
 struct      LavaFrame
 {
   enum FRAME { ERR_FRAME = 0xFFFFFFFFFFFFFFFE, NO_FRAME = 0xFFFFFFFFFFFFFFFF };
   static const u64 PACKET_SLOTS = 16;
 
   using       Slots = AtomicBitset;
-  using PacketArray = std::array<LavaPacket, PACKET_SLOTS>;
+  using PacketArray = std::array<LavaFramePacket, PACKET_SLOTS>;
 
   u64                dest = LavaId::NODE_NONE;             // The destination node this frame will be run with
   u64               cycle = 0;                             // The numer of this frame - lowest frame needs to be run first
-  u64           src_frame = 0;                             // Does this need to come from the message node?
-  u64          dest_frame = 0;                             // should this come from the node instance?
   Slots          slotMask;                                 // The bit mask respresenting which slots already have packets in them
-
+  u64            deadline = 0;                             // the earliest deadline of the packets in the frame, which its outputs keep - 0 is none
   u16               slots = 0;                             // The total number of slots needed for this frame to be complete 
-  PacketArray     packets;
-  //LavaPacket      packets[PACKET_SLOTS];
+  u16            priority = 0;                             // the highest priority of the packets in the frame, which its outputs keep
+  PacketArray     packets;                                 // only the slots up to the last one filled are written or copied
+
+  LavaFrame(){}
+  LavaFrame(LavaFrame const& r){ *this = r; }
+  LavaFrame&  operator=(LavaFrame const& r)
+  {
+    dest      =  r.dest;
+    cycle     =  r.cycle;
+    slotMask  =  r.slotMask;
+    deadline  =  r.deadline;
+    slots     =  r.slots;
+    priority  =  r.priority;
+    memcpy(packets.data(), r.packets.data(), r.used() * sizeof(LavaFramePacket));
+    return *this;
+  }
 
+  u64              used()         const                    // the number of packet slots up to and including the last one filled
+  {
+    return slotMask.bits?  msb64(slotMask.bits) + 1  :  0;
+  }
+  void        takeOrder(LavaPacket const& pkt)             // the frame runs as soon as its most urgent packet would
+  {
+    if(pkt.priority > priority){ priority = (u16)pkt.priority; }
+    if(pkt.deadline && (!deadline || pkt.deadline < deadline)){ deadline = pkt.deadline; }
+  }
   bool          putSlot(u64 sIdx, LavaPacket const& pkt)
   {
     if( slotMask[sIdx] ) return false;
 
     slotMask[sIdx] = true;
-    packets[sIdx] = pkt;
+    packets[sIdx]  = pkt;
+    takeOrder(pkt);
 
     return true;
   }
+  LavaPacket     packet(u64 sIdx)  const                   // a queue packet for a slot again, with the priority and deadline of the frame - not for the range of a split packet, whose LavaSplit record the frame does not keep
+  {
+    LavaFramePacket const& fp = packets[sIdx];
+    LavaPacket p;
+    memset(&p, 0, sizeof(p));
+    p.cycle       =  cycle;
+    p.priority    =  priority;
+    p.deadline    =  deadline;
+    p.dest_node   =  dest;
+    p.dest_slot   =  fp.dest_slot;
+    p.src_node    =  fp.src_node;
+    p.src_slot    =  fp.src_slot;
+    p.sz_bytes    =  fp.sz_bytes;
+    p.val         =  fp.val;
+    return p;
+  }
   u64         slotCount()         const
   {
     //return popcount64(slotMask.to_ulong());
@@ -854,6 +1425,12 @@ struct       LavaNode
   const char**      out_names = nullptr;
   const char*     description = nullptr;
   uint64_t            version = 0;
+  SplitFunc             split = nullptr;        // a node with one input can set this so that input packets of at least LavaFlow::splitBytes are cut into ranges of items that run on every thread - LavaRange() gives the node its range
+  GatherFunc           gather = nullptr;        // joins the outputs of the ranges of one split packet in range order - nullptr concatenates the bytes of the outputs for each output slot
+  uint64_t              batch = 0;              // a node with one input can set this above 1 to be given up to this many queued packets in one call, at most LavaFrame::PACKET_SLOTS - each is in its own frame slot and LavaNxtPckt() walks them
+
+  enum Exec { EXEC_DEFAULT=0, EXEC_SHARED, EXEC_EXCLUSIVE, EXEC_PINNED };
+  uint64_t               exec = EXEC_DEFAULT;   // EXEC_EXCLUSIVE runs the node on one thread at a time so its state needs no locks, EXEC_PINNED also keeps it on the first LavaLoop thread that runs it, for things like a graphics context - EXEC_DEFAULT is EXCLUSIVE for MSG nodes and SHARED for every other type
 };
 struct       LavaInst
 {
@@ -916,13 +1493,18 @@ struct        LavaMem
 {
   using au64 = std::atomic<uint64_t>;
    
+  static const uint64_t   SIZE_MASK = 0x0000FFFFFFFFFFFF;             // the low 48 bits of the second header word are the size in bytes
+  static const uint64_t OWNER_SHIFT = 48;                             // the high 16 bits are the reclaim slot of the LavaLoop thread that made it plus one - 0 is memory the flow doesn't own, like a LavaMemAllocation
+  static const uint64_t OWNER_CONST = 0xFFFF;                         // a read only memory mapped const file, with the header in the page in front of the mapping
+
   void*  ptr = nullptr;
 
   uint64_t    refCount()const{ return ((uint64_t*)ptr)[0]; }
-  uint64_t   sizeBytes()const{ return ((uint64_t*)ptr)[1]; }
+  uint64_t   sizeBytes()const{ return ((uint64_t*)ptr)[1] & SIZE_MASK; }
+  uint64_t       owner()const{ return ((uint64_t*)ptr)[1] >> OWNER_SHIFT; }
   uint64_t&   refCount()     { return ((uint64_t*)ptr)[0]; }
-  uint64_t&  sizeBytes()     { return ((uint64_t*)ptr)[1]; }
   void*           data()     { return ((uint64_t*)ptr)+2;  }
+  bool        readOnly()const{ return owner() == OWNER_CONST; }
 
   uint64_t      incRef()     { return ((au64*)ptr)->fetch_add( 1); }
   uint64_t      decRef()
@@ -954,6 +1536,32 @@ struct    LavaCommand
   union { Arg B; Arg  src; };
 };
 
+inline void  LavaConstUnmap(LavaMem lm)                                  // called by whichever thread drops the last reference to a mapped const, which is either a LavaLoop or the LavaConst being destroyed
+{
+  assert( lm.owner() == LavaMem::OWNER_CONST );
+
+  u8* view = (u8*)lm.data();
+  #ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    UnmapViewOfFile(view);
+    VirtualFree(view - si.dwAllocationGranularity, 0, MEM_RELEASE);
+  #else
+    u64 pg = (u64)sysconf(_SC_PAGESIZE);
+    munmap(view - pg, pg + lm.sizeBytes());
+  #endif
+}
+
+inline void LavaConstRelease(LavaNode* ln)                                // drops the reference a const node holds on its mapping - packets still in flight keep it mapped until the last of them is dropped
+{
+  if(!ln || !ln->filePtr){ return; }
+
+  LavaMem lm   = LavaMem::fromDataAddr( (uint64_t)ln->filePtr );
+  ln->filePtr  = nullptr;
+  ln->fileSize = 0;
+  if(lm.decRef() == 1){ LavaConstUnmap(lm); }
+}
+
 const        LavaNode LavaNodeListEnd = {nullptr, nullptr, nullptr, LavaNode::NONE, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, 0};
 
 struct      LavaConst
@@ -1002,6 +1610,8 @@ struct      LavaConst
   {
     if(node)
     {
+      LavaConstRelease(node);
+
       if(node->name)
         free( (void*)node->name );
 
@@ -1025,6 +1635,65 @@ extern "C" __declspec(dllexport) LavaNode* GetLavaFlowNodes();   // prototype of
 
 using lava_memvec = std::vector<LavaMem, ThreadAllocator<LavaMem> >;
 
+struct     LavaRoutes
+{
+// a flat copy of the source to destination connections of one graph buffer, used to route output packets
+// Design: built once when a graph buffer is swapped in and never changed while it is current, so the loop can read it without locks
+// rows is indexed by node id and gives where that node's output slots start in slots - node ids are handed out by a counter and normalizeIndices packs them from 1, so the array stays dense
+// slots gives where each output slot's destinations start in dests - they end where the next slot's start, so finding the destinations of an output is two indexed reads
+
+  using   u32vec = std::vector<u32>;
+  using   IdVec  = std::vector<LavaId>;
+  using   Range  = std::pair<LavaId const*, LavaId const*>;
+
+  u32vec     rows;                                               // node id -> first row in slots, rows[nid+1] is one past its last
+  u32vec    slots;                                               // row -> first index in dests, slots[row+1] is one past its last
+  IdVec     dests;                                               // destination slots in the order of the source multimap
+
+  void     clear(){ rows.clear(); slots.clear(); dests.clear(); }
+
+  template<class SRC_MAP> void build(SRC_MAP const& dc)          // dc is the destination connections multimap, which is sorted by node id then slot index
+  {
+    clear();
+    if(dc.size() == 0){ return; }
+
+    u64 maxNid = dc.rbegin()->first.nid;
+    rows.assign(maxNid+2, 0);
+    for(auto const& kv : dc){                                    // the rows of a node go up to its highest connected output slot
+      u32& r = rows[kv.first.nid+1];
+      r      = std::max<u32>(r, (u32)kv.first.sidx + 1);
+    }
+    TO(maxNid+1,i){ rows[i+1] += rows[i]; }
+
+    slots.assign(rows.back()+1, 0);
+    dests.reserve(dc.size());
+    for(auto const& kv : dc){
+      ++slots[ rows[kv.first.nid] + kv.first.sidx + 1 ];
+      dests.push_back(kv.second);
+    }
+    TO(slots.size()-1,i){ slots[i+1] += slots[i]; }
+  }
+  Range     node(u64 nid) const                                  // the destinations of every output slot of a node
+  {
+    if(nid+1 >= rows.size()){ return Range(nullptr, nullptr); }
+
+    LavaId const* d = dests.data();
+    return Range(d + slots[rows[nid]], d + slots[rows[nid+1]]);
+  }
+  Range     find(LavaId src) const
+  {
+    if(src.nid+1 >= rows.size()){ return Range(nullptr, nullptr); }
+
+    u64 row = rows[src.nid] + src.sidx;
+    if(row >= rows[src.nid+1]){ return Range(nullptr, nullptr); }
+
+    LavaId const* d = dests.data();
+    return Range(d + slots[row], d + slots[row+1]);
+  }
+};
+
+static thread_local u32  lava_thread_pins = 0;                            // graph buffers this thread has pinned - exec() and swapNodes() are never called while it is above 0, since they would wait on the thread's own pin
+
 class       LavaGraph                  // LavaGraph should specifically be about the connections between nodes
 {
 public:
@@ -1036,6 +1705,7 @@ public:
 
   using abool         =  std::atomic<bool>;
   using au32          =  std::atomic<uint32_t>;
+  using au64          =  std::atomic<uint64_t>;
   using NodeInsts     =  std::unordered_map<uint64_t, LavaInst>;       // maps an id to a LavaFlowNode struct
   using Slots         =  std::multimap<LavaId, LavaFlowSlot>;          // The key is a node id, the value is the index into the slot array.  Every node can have 0 or more slots. Slots can only have 1 and only 1 node. Slots have their node index in their struct so getting the node from the slots is easy. To get the slots that a node has, this multimap is used
   using CnctMap       =  std::unordered_map<LavaId, LavaId, LavaId>;   // maps connections from their single destination slot to their single source slot - Id is the hash function object in the third template argument
@@ -1046,10 +1716,24 @@ public:
   using vec_ids       =  std::vector<LavaId>;
   using GenIds        =  std::unordered_set<LavaId, LavaId>;           // LavaId has an operator() to hash itself
   using GenCache      =  std::vector<LavaId>;                          // LavaId has an operator() to hash itself
+  using FuseMap       =  std::unordered_map<uint64_t, LavaId>;         // maps a node whose only connection goes to a node with one input to that input slot, so LavaLoop can run the two back to back
   using NormalizeMap  =  std::map<uint64_t, uint64_t>;
   using CmdQ          =  std::queue<LavaCommand>;
   using RetStk        =  std::stack<LavaCommand::Arg>;
   using ArgVec        =  std::vector<LavaCommand::Arg>;
+  using CmdVec        =  std::vector<LavaCommand>;
+  using NodeSwaps     =  std::unordered_map<LavaNode*, LavaNode*>;     // maps the nodes of an unloaded shared library to the nodes with the same names in its reloaded version - null if it no longer has one
+
+  struct alignas(64) ReadPin { abool inUse; au32 buf; };              // buf is 0 when the thread is not reading the graph, 1 when it is reading buffer A and 2 for buffer B - each is on its own cache line so pinning every iteration does not bounce lines between threads
+  using ReadPins      =  std::array<ReadPin, LAVA_MAX_THREADS>;
+
+  struct    ReadGuard                                                  // pins the current buffer for one LavaLoop iteration - exec() will not write to a buffer while a thread has it pinned
+  {
+    LavaGraph* g;  u32 idx;  u32 buf;
+    ReadGuard(LavaGraph& _g, u32 _idx) : g(&_g), idx(_idx), buf( _g.readBegin(_idx) ) {}
+    ~ReadGuard(){ release(); }
+    void release(){ if(buf){ g->readEnd(idx, buf); buf = 0; } }
+  };
 
 private:
   mutable abool         m_useA;
@@ -1057,6 +1741,10 @@ private:
   uint64_t             m_nxtId;               // nxtId is next id - a counter for every node created that only increases, giving each node a unique id
   CmdQ                  m_cmdq;
   RetStk                 m_stk;
+  CmdVec            m_lastCmds;               // the commands of the last exec(), which the opposite buffer has not seen yet - the next exec() replays them on it instead of copying the whole current buffer
+  bool              m_oppStale;               // set when the current buffer was changed outside of exec(), so the next exec() has to copy all of it
+  ReadPins              m_pins;
+  au32         m_sharedReaders[2];            // readers of A and B that could not claim a pin, counted together
 
   NodeInsts           m_nodesA;
   Slots             m_inSlotsA;
@@ -1065,6 +1753,8 @@ private:
   SrcMap          m_destCnctsA;
   GenIds           m_genNodesA;
   GenCache         m_genCacheA;
+  FuseMap              m_fuseA;
+  LavaRoutes         m_routesA;
 
   NodeInsts           m_nodesB;
   Slots             m_inSlotsB;
@@ -1073,6 +1763,8 @@ private:
   SrcMap          m_destCnctsB;
   GenIds           m_genNodesB;
   GenCache         m_genCacheB;
+  FuseMap              m_fuseB;
+  LavaRoutes         m_routesB;
 
 public:
   NodeInsts&            curNodes(){ return m_useA.load()?  m_nodesA     : m_nodesB;     }
@@ -1082,6 +1774,9 @@ public:
   SrcMap&           curDestCncts(){ return m_useA.load()?  m_destCnctsA : m_destCnctsB; }
   GenIds&            curGenNodes(){ return m_useA.load()?  m_genNodesA  : m_genNodesB;  }
   GenCache&          curMsgCache(){ return m_useA.load()?  m_genCacheA  : m_genCacheB;  }
+  LavaRoutes&          curRoutes(){ return m_useA.load()?  m_routesA    : m_routesB;    }
+  FuseMap   const&       curFuse()const{ return m_useA.load()?  m_fuseA      : m_fuseB;      }
+  LavaRoutes const&      routes()const{ return m_useA.load()?  m_routesA    : m_routesB;    }
   NodeInsts const&      curNodes()const{ return m_useA.load()?  m_nodesA     : m_nodesB;     }
   Slots     const&    curInSlots()const{ return m_useA.load()?  m_inSlotsA     : m_inSlotsB;     }
   Slots     const&   curOutSlots()const{ return m_useA.load()?  m_outSlotsA     : m_outSlotsB;     }
@@ -1097,6 +1792,8 @@ public:
   SrcMap&           oppDestCncts(){ return !m_useA.load()?  m_destCnctsA : m_destCnctsB; }
   GenIds&            oppGenNodes(){ return !m_useA.load()?  m_genNodesA  : m_genNodesB;  }
   GenCache&          oppMsgCache(){ return !m_useA.load()?  m_genCacheA  : m_genCacheB;  }
+  FuseMap&               oppFuse(){ return !m_useA.load()?  m_fuseA      : m_fuseB;      }
+  LavaRoutes&          oppRoutes(){ return !m_useA.load()?  m_routesA    : m_routesB;    }
   NodeInsts const&      oppNodes()const{ return !m_useA.load()?  m_nodesA     : m_nodesB;     }
   Slots     const&    oppInSlots()const{ return !m_useA.load()?  m_inSlotsA   : m_inSlotsB;   }
   Slots     const&   oppOutSlots()const{ return !m_useA.load()?  m_outSlotsA  : m_outSlotsB;  }
@@ -1108,7 +1805,11 @@ public:
   void            init()
   { 
     m_useA.store(true);
-    m_nxtId = 1;
+    m_nxtId    = 1;
+    m_oppStale = false;
+    m_lastCmds.clear();
+    m_sharedReaders[0].store(0);
+    m_sharedReaders[1].store(0);
   }
   void              mv(LavaGraph&& rval)
   {
@@ -1120,6 +1821,8 @@ public:
     m_outSlotsA  = move(rval.m_outSlotsA); 
     m_cnctsA     = move(rval.m_cnctsA); 
     m_destCnctsA = move(rval.m_destCnctsA);
+    m_fuseA      = move(rval.m_fuseA);
+    m_routesA    = move(rval.m_routesA);
 
     m_nodesB     = move(rval.m_nodesB); 
     //m_slotsB     = move(rval.m_slotsB); 
@@ -1127,6 +1830,9 @@ public:
     m_outSlotsB  = move(rval.m_outSlotsB);
     m_cnctsB     = move(rval.m_cnctsB); 
     m_destCnctsB = move(rval.m_destCnctsB);
+    m_fuseB      = move(rval.m_fuseB);
+    m_routesB    = move(rval.m_routesB);
+    m_oppStale   = true;                      // m_useA is not moved, so the buffers are synced with a full copy on the next exec()
 
     //m_running   = rval.m_running;
     //m_ids       = move(rval.m_ids);
@@ -1141,6 +1847,8 @@ public:
     m_outSlotsA  = lval.m_outSlotsA; 
     m_cnctsA     = lval.m_cnctsA; 
     m_destCnctsA = lval.m_destCnctsA;
+    m_fuseA      = lval.m_fuseA;
+    m_routesA    = lval.m_routesA;
 
     m_nodesB     = lval.m_nodesB;
     //m_slotsB     = lval.m_slotsB;
@@ -1148,9 +1856,54 @@ public:
     m_outSlotsB  = lval.m_outSlotsB;
     m_cnctsB     = lval.m_cnctsB; 
     m_destCnctsB = lval.m_destCnctsB;
+    m_fuseB      = lval.m_fuseB;
+    m_routesB    = lval.m_routesB;
+    m_oppStale   = true;
   }
   u64            nxtId(){ return m_nxtId++; }
 
+  // concurrent readers
+  u32         claimPin()                                               // returns LAVA_MAX_THREADS if every pin is taken, in which case the thread is counted in m_sharedReaders
+  {
+    TO(LAVA_MAX_THREADS,i){
+      bool expected = false;
+      if( !m_pins[i].inUse.load() && m_pins[i].inUse.compare_exchange_strong(expected, true) ){ return (u32)i; }
+    }
+    return LAVA_MAX_THREADS;
+  }
+  void      releasePin(u32 idx)
+  {
+    if(idx < LAVA_MAX_THREADS){ m_pins[idx].buf.store(0); m_pins[idx].inUse.store(false); }
+  }
+  u32        readBegin(u32 idx)                                        // returns the buffer that was pinned, 1 for A and 2 for B
+  {
+    for(;;){
+      u32 buf = m_useA.load()?  1  :  2;
+      if(idx < LAVA_MAX_THREADS){ m_pins[idx].buf.store(buf); }
+      else                        m_sharedReaders[buf-1].fetch_add(1);
+
+      if( (m_useA.load()? 1u : 2u) == buf ){ ++lava_thread_pins; return buf; }   // if exec() flipped between the load and the pin, it may already be past the check for this buffer, so pin the new one instead
+
+      if(idx >= LAVA_MAX_THREADS){ m_sharedReaders[buf-1].fetch_sub(1); }
+    }
+  }
+  void         readEnd(u32 idx, u32 buf)
+  {
+    if(idx < LAVA_MAX_THREADS){ m_pins[idx].buf.store(0); }
+    else                        m_sharedReaders[buf-1].fetch_sub(1);
+    --lava_thread_pins;
+  }
+  bool          pinned(u32 buf) const                                  // true while a thread is still in an iteration that started while buf was current
+  {
+    bool p = m_sharedReaders[buf-1].load() > 0;
+    TO(LAVA_MAX_THREADS,i){ p = p || m_pins[i].buf.load() == buf; }
+    return p;
+  }
+  void     waitReaders(u32 buf)                                        // the grace period - returns once no thread is still in an iteration that started while buf was current
+  {
+    while( pinned(buf) ){ std::this_thread::yield(); }
+  }
+
   auto   nodeDestSlots(vec_nptrs const& nds) -> vec_ids
   {
     using namespace std;
@@ -1313,6 +2066,8 @@ public:
       nxtDestCncts.insert({nxtSrc, nxtDest});
     }
     curDestCncts() = move(nxtDestCncts);
+    curRoutes().build( curDestCncts() );
+    m_oppStale = true;
 
     SECTION(in slots)
     {
@@ -1381,6 +2136,7 @@ public:
     curCncts().clear();
     curDestCncts().clear();
     curGenNodes().clear();
+    curRoutes().clear();
 
     oppNodes().clear();
     oppInSlots().clear();
@@ -1388,6 +2144,7 @@ public:
     oppCncts().clear();
     oppDestCncts().clear();
     oppGenNodes().clear();
+    oppRoutes().clear();
 
     while(m_cmdq.size()>0) m_cmdq.pop();
     while(m_stk.size()>0) m_stk.pop();
@@ -1405,88 +2162,200 @@ public:
   {
     using namespace std;
     
+    assert(lava_thread_pins == 0);
+
     ArgVec returned;
     auto sz = m_cmdq.size();
-    if(sz > 0)
+    if(sz > 0 && !pinned( m_useA.load()? 2 : 1 ))                       // a thread still in an iteration on the opposite buffer leaves the commands queued for the next exec(), so a slow node does not hold up the caller
     {
-      if(m_useA.load()){
-        m_nodesB     = m_nodesA;
-        //m_slotsB     = m_slotsA; 
-        m_inSlotsB   = m_inSlotsA; 
-        m_outSlotsB  = m_outSlotsA; 
-        m_cnctsB     = m_cnctsA; 
-        m_destCnctsB = m_destCnctsA;
-        m_genNodesB  = m_genNodesA;
-        m_genCacheB  = m_genCacheA;
-      }else{
-        m_nodesA     = m_nodesB;
-        //m_slotsA     = m_slotsB; 
-        m_inSlotsA   = m_inSlotsB; 
-        m_outSlotsA  = m_outSlotsB; 
-        m_cnctsA     = m_cnctsB; 
-        m_destCnctsA = m_destCnctsB;
-        m_genNodesA  = m_genNodesB;
-        m_genCacheA  = m_genCacheB;
-      }
+      syncOpp();
 
+      m_lastCmds.clear();
       while(m_cmdq.size() > 0)
       {
         auto lc = m_cmdq.front();                 // lc is LavaCommand
         m_cmdq.pop();
-        switch(lc.cmd)
-        {
-          case LavaCommand::TGL_CNCT:{
-            this->toggleCnct(lc.src.id, lc.dest.id);
-          }break;
-
-          case LavaCommand::DEL_CNCT:{
-            this->delCnct(lc.A.id);
-          }break;
-
-          case LavaCommand::ADD_NODE:{
-            u64 nid = this->addNode(lc.A.ndptr, lc.B.val);
-            LavaCommand::Arg ret;
-            ret.id.nid = nid;
-            m_stk.push(ret);
-            returned.push_back(ret);
-          }break;
-
-          case LavaCommand::DEL_NODE:{
-            this->delNode(lc.A.id.nid);
-          }break;
-
-          case LavaCommand::ADD_SLOT:{
-            LavaFlowSlot s(m_stk.top().id.nid, lc.A.slotDest);
-            m_stk.pop();
-            LavaId sid = this->addSlot(s); // lc.A.id.sidx);
-            LavaCommand::Arg ret;
-            ret.id = sid;
-            m_stk.push(ret);
-            returned.push_back(ret);
-          }break;
-
-          default: break;
-        };
+        applyCmd(lc, &returned);
+        m_lastCmds.push_back(lc);
       }
 
-      while(m_stk.size()>0){ m_stk.pop(); }
-      
-      auto& mcache = oppMsgCache();                                        // mcache is message cache
-      auto&    cur = oppGenNodes();
-      mcache.clear();
-      mcache.reserve( cur.size() );
+      publishOpp();
+    }
+
+    return returned;
+  }
+  void         swapNodes(NodeSwaps const& swaps)                         // called from the thread that calls exec() - points instances at the nodes of a reloaded shared library while the flow threads run, and returns once none of them can still be running an old node
+  {
+    using namespace std;
 
-      for(auto const& lid : cur){
-        mcache.push_back(lid.nid);
+    if(swaps.size() < 1){ return; }
+    assert(lava_thread_pins == 0);
+
+    auto retarget = [&swaps](NodeInsts& nds){
+      for(auto& kv : nds){
+        auto si = swaps.find(kv.second.node);
+        if(si != swaps.end()){ kv.second.node = si->second; }
       }
+    };
+    auto retargetCmd = [&swaps](LavaCommand& lc){
+      if(lc.cmd != LavaCommand::ADD_NODE){ return; }
+      auto si = swaps.find(lc.A.ndptr);
+      if(si != swaps.end()){ lc.A.ndptr = si->second; }
+    };
 
-      m_useA.store( !m_useA.load() );                                      // this should be the only place where it is flipped, so the store is all that matters
+    CmdQ q;                                                              // commands waiting for the next exec() can hold the old pointers too
+    for(; m_cmdq.size()>0; m_cmdq.pop()){
+      auto lc = m_cmdq.front();
+      retargetCmd(lc);
+      q.push(lc);
     }
+    m_cmdq = move(q);
 
-    return returned;
+    for(auto& kv : curNodes()){                                          // states are written in place on the current buffer and carried over by publishOpp()
+      auto si = swaps.find(kv.second.node);
+      if(si != swaps.end() && !si->second){ kv.second.setState(LavaInst::LOAD_ERROR); }     // the reloaded library no longer has this node
+    }
+
+    waitReaders( m_useA.load()? 2 : 1 );                                 // unlike exec() this has to wait, since the old library is unloaded as soon as it returns
+    syncOpp();                                                           // the opposite buffer is made the same as the current one, then only the node pointers differ
+    m_lastCmds.clear();
+    retarget( oppNodes() );
+    publishOpp();
+
+    waitReaders( m_useA.load()? 2 : 1 );                                 // the quiescent point - every thread that could have read an old pointer was in an iteration that pinned the buffer that is now opposite
+    retarget( oppNodes() );                                              // both buffers are the same again, so the next exec() has nothing to replay
   }
 
   // opposite buffer changes
+  void         syncOpp()                                                 // brings the opposite buffer up to date with the current one - only once no thread has it pinned
+  {
+    if(!m_oppStale) SECTION(bring the opposite buffer up to date by replaying the commands it missed - this is proportional to the edits and not to the size of the graph)
+    {
+      for(auto const& lc : m_lastCmds){ applyCmd(lc, nullptr); }
+      while(m_stk.size()>0){ m_stk.pop(); }
+    }
+    else if(m_useA.load()){
+      m_nodesB     = m_nodesA;
+      //m_slotsB     = m_slotsA; 
+      m_inSlotsB   = m_inSlotsA; 
+      m_outSlotsB  = m_outSlotsA; 
+      m_cnctsB     = m_cnctsA; 
+      m_destCnctsB = m_destCnctsA;
+      m_genNodesB  = m_genNodesA;
+      m_genCacheB  = m_genCacheA;
+    }else{
+      m_nodesA     = m_nodesB;
+      //m_slotsA     = m_slotsB; 
+      m_inSlotsA   = m_inSlotsB; 
+      m_outSlotsA  = m_outSlotsB; 
+      m_cnctsA     = m_cnctsB; 
+      m_destCnctsA = m_destCnctsB;
+      m_genNodesA  = m_genNodesB;
+      m_genCacheA  = m_genCacheB;
+    }
+    m_oppStale = false;
+  }
+  void      publishOpp()                                                 // rebuilds what is derived from the opposite buffer, then makes it current
+  {
+    while(m_stk.size()>0){ m_stk.pop(); }
+    syncInstState();
+    
+    auto& mcache = oppMsgCache();                                        // mcache is message cache
+    auto&    cur = oppGenNodes();
+    mcache.clear();
+    mcache.reserve( cur.size() );
+
+    for(auto const& lid : cur){
+      mcache.push_back(lid.nid);
+    }
+
+    findFusible();
+    oppRoutes().build( oppDestCncts() );                                 // routing reads this flat table instead of searching the multimap
+
+    m_useA.store( !m_useA.load() );                                      // this should be the only place where it is flipped, so the store is all that matters
+  }
+  void       applyCmd(LavaCommand const& lc, ArgVec* returned)            // returned is null when replaying, since the ids were already given back the first time
+  {
+    switch(lc.cmd)
+    {
+      case LavaCommand::TGL_CNCT:{
+        this->toggleCnct(lc.src.id, lc.dest.id);
+      }break;
+
+      case LavaCommand::DEL_CNCT:{
+        this->delCnct(lc.A.id);
+      }break;
+
+      case LavaCommand::ADD_NODE:{
+        u64 nid = this->addNode(lc.A.ndptr, lc.B.val);
+        LavaCommand::Arg ret;
+        ret.id.nid = nid;
+        m_stk.push(ret);
+        if(returned){ returned->push_back(ret); }
+      }break;
+
+      case LavaCommand::DEL_NODE:{
+        this->delNode(lc.A.id.nid);
+      }break;
+
+      case LavaCommand::ADD_SLOT:{
+        LavaFlowSlot s(m_stk.top().id.nid, lc.A.slotDest);
+        m_stk.pop();
+        LavaId sid = this->addSlot(s); // lc.A.id.sidx);
+        LavaCommand::Arg ret;
+        ret.id = sid;
+        m_stk.push(ret);
+        if(returned){ returned->push_back(ret); }
+      }break;
+
+      default: break;
+    };
+  }
+  void    syncInstState()                                                  // the run state, cycle and time of nodes are written in place on the current buffer, so they are carried over before the flip
+  {
+    auto const& cur = curNodes();
+    for(auto& kv : oppNodes()){
+      auto ci = cur.find(kv.first);
+      if(ci == cur.end()){ continue; }
+
+      LavaInst const& c = ci->second;
+      LavaInst&       o = kv.second;
+      o.stateU32  =  ((au32*)&c.stateU32)->load();
+      o.cycle     =  ((au64*)&c.cycle)->load();
+      o.time      =  ((au64*)&c.time)->load();
+    }
+  }
+  void    findFusible()                                                    // a chain link is a node with exactly one outgoing connection into a FLOW node whose one input has that as its only source - split and batch nodes are left out since they need the queue
+  {
+    using namespace std;
+
+    auto&      fuse = oppFuse();
+    auto const& nds = oppNodes();
+    fuse.clear();
+
+    unordered_map<u64, u64> outCnt;
+    for(auto const& kv : oppDestCncts()){ ++outCnt[kv.first.nid]; }
+
+    for(auto const& kv : oppDestCncts())
+    {
+      LavaId src = kv.first, dest = kv.second;
+      if(outCnt[src.nid] != 1 || src.nid == dest.nid){ continue; }
+
+      auto di = nds.find(dest.nid);
+      if(di == nds.end()){ continue; }
+      LavaInst const& li = di->second;
+      if(!li.node || li.inputs != 1 || li.node->node_type != LavaNode::FLOW){ continue; }
+      if(li.node->split || li.node->batch > 1){ continue; }
+
+      fuse[src.nid] = dest;
+    }
+  }
+  LavaId    fusedDest(u64 nid) const                                       // the input slot a node's output can be handed to directly, or a LavaId with NODE_NONE
+  {
+    auto const& fuse = curFuse();
+    auto          fi = fuse.find(nid);
+    return fi != fuse.end()?  fi->second  :  LavaId();
+  }
   uint64_t    addNode(LavaNode* ln, uint64_t nid)
   {
     LavaInst li = makeInst(nid, ln);
@@ -1727,113 +2596,1334 @@ public:
   }
   auto     nodeOutSlots(u64     nid) const -> decltype(curOutSlots().cbegin())
   {
-    return lower_bound(ALL(curInSlots()), nid, [](auto a,auto b){ return a.first.nid < b; } );
+    return lower_bound(ALL(curInSlots()), nid, [](auto a,auto b){ return a.first.nid < b; } );
+  }
+  auto     nodeOutSlots(u64     nid) -> decltype(oppOutSlots().begin())
+  {
+    return lower_bound(ALL(oppOutSlots()), nid, [](auto a,auto b){ return a.first.nid < b; } );
+  }
+  auto          inSlots()  -> Slots& { return curInSlots(); }
+  auto          inSlots() const -> Slots const& { return curInSlots();  }
+  auto       getInSlots() -> Slots& { return curInSlots(); }
+  auto         outSlots() -> Slots& { return curOutSlots(); }
+  auto         outSlots() const -> Slots const& { return curOutSlots();  }
+  auto      getOutSlots() -> Slots& { return curOutSlots(); }
+
+  auto          srcSlot(LavaId destId) -> LavaFlowSlot* 
+  {
+    auto ci = curCncts().find(destId);
+    if(ci != curCncts().end()){
+      //LavaFlowSlot* s = slot(ci->second);
+      LavaFlowSlot* s = outSlot(ci->second);
+      return s;
+    }else 
+      return nullptr;
+  }
+  auto        destSlots(LavaId  srcId) -> decltype(curDestCncts().find(srcId))
+  {
+    return curDestCncts().find(srcId);
+  }
+  auto        inSlotEnd() -> decltype(curInSlots().end()) { return curInSlots().end(); }
+  u64           inSltSz() const { return curInSlots().size(); }
+  auto       outSlotEnd() -> decltype(curOutSlots().end()) { return curOutSlots().end(); }
+  u64          outSltSz() const { return curOutSlots().size(); }
+
+  // connection deletion
+  u32     delSrcCncts(LavaId  src)
+  {
+    u32  cnt = 0;
+    auto  di = oppDestCncts().find(src);
+    for(; di!=oppDestCncts().end() && di->first==src; ++cnt, ++di){   // ++di,
+      oppCncts().erase(di->second);
+    }
+    oppDestCncts().erase(src);
+
+    return cnt;
+
+    //di = m_destCncts.find(src);
+  }
+  bool    delDestCnct(LavaId dest)
+  {
+    auto iter = oppCncts().find(dest);
+    if(iter==oppCncts().end()) return false;
+
+    auto src = iter->second;
+    oppCncts().erase(dest);
+
+    auto srcIter = oppDestCncts().find(src);
+    for(; srcIter!=end(oppDestCncts()) && srcIter->first==src && srcIter->second==dest; ){
+      auto cpy = srcIter++;
+      oppDestCncts().erase(cpy);
+    }
+
+    return true;
+  }
+  u32         delCnct(LavaId   id)
+  {
+    u32 cnt = 0;
+    //LavaFlowSlot* s = this->slot(id);
+    LavaFlowSlot* s =  id.isIn? inSlot(id)  :  outSlot(id);
+    if(!s) return 0;
+
+    if(s->in){
+      auto iter = oppCncts().find(id);
+      if(iter==oppCncts().end()){ return 0; }
+
+      return delCnct(iter->second, iter->first);
+    }else{
+      auto iter = oppDestCncts().find(id);
+      if(iter==oppDestCncts().end()){ return 0; }
+
+      auto  idx = iter->first;
+      while(iter != oppDestCncts().end() && iter->first == idx){
+        oppCncts().erase(iter->second);
+        iter = oppDestCncts().erase(iter);
+        ++cnt;
+      }
+    }
+
+    return cnt;
+  }
+
+  // connection reading
+  auto      destCncts(LavaId  src) -> decltype(curDestCncts().begin()) // C++14 -> decltype(m_slots.find(Id(nid)))
+  {
+    return lower_bound(ALL(curDestCncts()), LavaId(src), [](auto a,auto b){ return a.first < b; } );
+  }
+  u64   destCnctCount(LavaId  src)
+  {
+    return curDestCncts().count(src);
+  }
+  auto    destCnctEnd() -> decltype(curDestCncts().end()) { return curDestCncts().end(); }
+  auto        cnctEnd() -> decltype(curCncts().end())     { return curCncts().end(); }
+  auto      cnctBegin() -> decltype(curCncts().begin())   { return curCncts().begin(); }
+  auto          cncts() -> CnctMap& { return curCncts(); }
+  auto          cncts() const -> CnctMap const& { return curCncts(); }
+  u64          cnctsz() const { return curCncts().size(); }
+  auto    srcCnctsMap() -> SrcMap&
+  {
+    return curDestCncts();
+  }
+};
+struct     LavaMultiQ
+{
+// relaxed concurrent priority queue of packets
+// Design: Many small heaps, each with its own spin lock and an atomically readable copy of its top packet's rank from LavaPacketOrder
+// Push goes to a random heap, pop looks at the top of two random heaps and takes from the one with the lower rank - since only two heaps are locked at any one time, threads rarely contend
+// Ordering is relaxed - the packet popped is likely but not guaranteed to be the first by the LavaPacketOrder, which is fine since frames are matched by their cycle and not by their order
+
+  using      au64 = std::atomic<uint64_t>;
+  using     abool = std::atomic<bool>;
+  using      Heap = std::priority_queue<LavaPacket, std::vector<LavaPacket>, LavaPacketOrder>;
+
+  static const u64  EMPTY_RANK = 0xFFFFFFFFFFFFFFFF;
+  static const u32   POP_TRIES = 8;
+
+  struct alignas(64) SubQ                                               // aligned to a cache line so that the spin locks of neighboring heaps don't share a cache line
+  {
+    abool      lck = false;
+    au64   topRank = EMPTY_RANK;
+    Heap      heap;
+
+    bool   tryLock(){ return !lck.load(std::memory_order_relaxed) && !lck.exchange(true, std::memory_order_acquire); }
+    void    unlock(){ lck.store(false, std::memory_order_release); }
+  };
+
+  LavaPacketOrder   m_order;
+  std::vector<SubQ>   m_qs;
+  au64              m_size = 0;
+
+  void        storeTop(SubQ& sq){ sq.topRank.store( sq.heap.size()>0? m_order.rank(sq.heap.top()) : EMPTY_RANK ); }
+
+  static u64     rnd()                                                   // xorshift64* - per thread so that picking heaps doesn't need any shared state
+  {
+    static thread_local u64 s = 0;
+    if(s==0){ s = (u64)(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1; }
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    return s * 0x2545F4914F6CDD1Dull;
+  }
+
+  LavaMultiQ(){}
+  LavaMultiQ(u64 subQueues, LavaPacketOrder order = LavaPacketOrder()) : 
+    m_order(order),
+    m_qs(subQueues)
+  {
+    for(auto& sq : m_qs){ sq.heap = Heap(order); }
+  }
+
+  u64         size()  const { return m_size.load(); }
+  u64    heapCount()  const { return m_qs.size(); }
+  void        push(LavaPacket const& pkt)
+  {
+    u64 sz = m_qs.size();
+    assert(sz > 0);
+    for(;;){
+      SubQ& sq = m_qs[ rnd() % sz ];
+      if( !sq.tryLock() ){ continue; }
+        sq.heap.push(pkt);
+        storeTop(sq);
+        m_size.fetch_add(1);
+      sq.unlock();
+      return;
+    }
+  }
+  bool    popFrom(SubQ& sq, LavaPacket* outPkt)
+  {
+    if( !sq.tryLock() ){ return false; }
+    bool ok = sq.heap.size() > 0;
+    if(ok){
+      *outPkt = sq.heap.top();
+      sq.heap.pop();
+      storeTop(sq);
+      m_size.fetch_sub(1);
+    }
+    sq.unlock();
+    return ok;
+  }
+  bool         pop(LavaPacket* outPkt)
+  {
+    u64 sz = m_qs.size();
+    while(m_size.load() > 0)
+    {
+      TO(POP_TRIES,t){                                                   // take the better of two random choices
+        SubQ& a = m_qs[ rnd() % sz ];
+        SubQ& b = m_qs[ rnd() % sz ];
+        SubQ& c = a.topRank.load() <= b.topRank.load()?  a  :  b;
+        if( c.topRank.load() == EMPTY_RANK ){ continue; }
+        if( popFrom(c, outPkt) ){ return true; }
+      }
+      TO(sz,i){                                                          // random choices keep missing, so sweep all the heaps so that a few remaining packets can't be skipped over indefinitely
+        if( m_qs[i].topRank.load() == EMPTY_RANK ){ continue; }
+        if( popFrom(m_qs[i], outPkt) ){ return true; }
+      }
+    }
+    return false;
+  }
+  template<class MATCH> u32 popWhile(MATCH match, LavaPacket* outPkts, u32 mx)   // takes up to mx packets off the tops of a few random heaps for as long as they match - used to batch packets for one node without sweeping every heap
+  {
+    u64 sz = m_qs.size();
+    u32 cnt = 0;
+    TO(POP_TRIES,t)
+    {
+      if(cnt>=mx || m_size.load()==0){ break; }
+
+      SubQ& sq = m_qs[ rnd() % sz ];
+      if( sq.topRank.load()==EMPTY_RANK || !sq.tryLock() ){ continue; }
+        while(cnt<mx && sq.heap.size()>0 && match(sq.heap.top())){
+          outPkts[cnt++] = sq.heap.top();
+          sq.heap.pop();
+          m_size.fetch_sub(1);
+        }
+        storeTop(sq);
+      sq.unlock();
+    }
+    return cnt;
+  }
+  bool        peek(LavaPacket* outPkt)                                  // copies out the packet with the lowest rank without removing it - only used for visualization
+  {
+    u64 mn = EMPTY_RANK;
+    SubQ* mnq = nullptr;
+    for(auto& sq : m_qs){
+      u64 c = sq.topRank.load();
+      if(c < mn){ mn = c; mnq = &sq; }
+    }
+    if(!mnq) return false;
+
+    while( !mnq->tryLock() ){}
+      bool ok = mnq->heap.size() > 0;
+      if(ok){ *outPkt = mnq->heap.top(); }
+    mnq->unlock();
+    return ok;
+  }
+};
+struct    LavaStealQ
+{
+// per-thread deque of packets for LOCAL_FIRST scheduling
+// The owning thread pushes and pops the back, so the packet it just made is run next while its memory is still in cache. Other threads steal from the front, taking the oldest packets
+// A spin lock is enough here since the only contention is the owner against an occasional thief
+
+  using     abool = std::atomic<bool>;
+  using      au64 = std::atomic<uint64_t>;
+  using     Deque = std::deque<LavaPacket>;
+
+  static const u64 CAPACITY = 64;                                       // past this, packets go to the global queue so one thread's backlog can't hide work from the others
+
+  alignas(64)
+  abool      lck = false;
+  abool    inUse = false;                                               // whether a LavaLoop thread currently owns this deque
+  au64        sz = 0;
+  Deque       dq;
+
+  void     lock(){ while( lck.load(std::memory_order_relaxed) || lck.exchange(true, std::memory_order_acquire) ){} }
+  void   unlock(){ lck.store(false, std::memory_order_release); }
+
+  u64      size() const { return sz.load(); }
+  bool     push(LavaPacket const& pkt)
+  {
+    if(sz.load() >= CAPACITY){ return false; }
+
+    lock();
+      dq.push_back(pkt);
+      sz.store(dq.size());
+    unlock();
+    return true;
+  }
+  bool      pop(LavaPacket* outPkt)
+  {
+    if(sz.load() == 0){ return false; }
+
+    lock();
+      bool ok = dq.size() > 0;
+      if(ok){
+        *outPkt = dq.back();
+        dq.pop_back();
+        sz.store(dq.size());
+      }
+    unlock();
+    return ok;
+  }
+  template<class MATCH> u32 popWhile(MATCH match, LavaPacket* outPkts, u32 mx)   // the owner takes packets off the back for as long as they match
+  {
+    if(sz.load() == 0){ return 0; }
+
+    u32 cnt = 0;
+    lock();
+      while(cnt<mx && dq.size()>0 && match(dq.back())){
+        outPkts[cnt++] = dq.back();
+        dq.pop_back();
+      }
+      sz.store(dq.size());
+    unlock();
+    return cnt;
+  }
+  bool    steal(LavaPacket* outPkt)
+  {
+    if(sz.load() == 0){ return false; }
+
+    lock();
+      bool ok = dq.size() > 0;
+      if(ok){
+        *outPkt = dq.front();
+        dq.pop_front();
+        sz.store(dq.size());
+      }
+    unlock();
+    return ok;
+  }
+  void    clear()
+  {
+    lock();
+      dq.clear();
+      sz.store(0);
+    unlock();
+  }
+};
+struct    LavaSplit
+{
+// the gather record for one packet that was split into ranges
+// Design: the thread that splits a packet makes this record and puts its address in the split field of every range packet
+// Each range keeps its outputs at its own index of parts, so no lock is needed - the thread that finishes the last range gathers them in range order and deletes the record
+
+  using   abool = std::atomic<bool>;
+  using    au64 = std::atomic<u64>;
+  using  OutVec = std::vector<LavaOut>;
+
+  u64                  items = 0;                                // items the node reported for the whole packet
+  u64                  chunk = 0;                                // items in each range - the last range can have fewer
+  au64             remaining;                                    // ranges that have not finished running
+  abool               failed;                                    // a range had an error or a null output, so nothing is gathered
+  std::vector<OutVec>  parts;                                    // the outputs of each range
+
+  LavaSplit(u64 _items, u64 ranges) : 
+    items(_items),
+    chunk( (_items + ranges - 1) / ranges )
+  {
+    u64 cnt = (items + chunk - 1) / chunk;                       // rounding up the chunk can leave fewer ranges than were asked for
+    parts.resize(cnt);
+    remaining.store(cnt);
+    failed.store(false);
+  }
+
+  u64       ranges()                       const { return parts.size(); }
+  u64     rangeIdx(LavaPacket const& pkt)  const { return pkt.rangeStart / chunk; }
+};
+struct  LavaFrameMap
+{
+// concurrent map from (destination node, cycle) to the frame that packets for that node and cycle are being gathered into
+// Design: the key hashes to one of SHARDS small maps, each with its own spin lock and its own pool of frames to reuse
+// Only finding a frame and claiming a slot happen inside a shard's lock - the packet is copied in after the lock is released and the thread whose copy fills the last slot takes the frame
+// Since a frame is taken out of its map as soon as its last slot is claimed, no thread can find it after that, so the thread that finishes it owns it outright
+
+  using     abool = std::atomic<bool>;
+  using      au32 = std::atomic<uint32_t>;
+
+  static const u64 SHARDS = 64;
+
+  struct      Key
+  {
+    u64 dest, cycle;
+    bool operator==(Key const& r) const { return dest==r.dest && cycle==r.cycle; }
+  };
+  struct  KeyHash
+  {
+    size_t operator()(Key const& k) const { return std::hash<u64>()( (k.dest * 0x9E3779B97F4A7C15ull) ^ k.cycle ); }
+  };
+  struct    Entry
+  {
+    LavaFrame    frm;
+    Entry*       nxt = nullptr;                                          // a second packet for a slot that is already filled starts another frame with the same key, chained after the first
+    u32       filled = 0;                                                // incremented atomically after each packet is copied in
+  };
+  using  EntryMap = std::unordered_map<Key, Entry*, KeyHash>;
+  using      Pool = std::vector<Entry*>;
+
+  struct alignas(64) Shard
+  {
+    abool      lck = false;
+    EntryMap   map;
+    Pool      pool;
+
+    void   lock(){ while( lck.load(std::memory_order_relaxed) || lck.exchange(true, std::memory_order_acquire) ){} }
+    void unlock(){ lck.store(false, std::memory_order_release); }
+  };
+
+  std::array<Shard, SHARDS>  m_shards;
+
+  LavaFrameMap(){}
+  ~LavaFrameMap()
+  {
+    clear();
+    for(auto& sh : m_shards){
+      for(auto e : sh.pool){ delete e; }
+      sh.pool.clear();
+    }
+  }
+  LavaFrameMap(LavaFrameMap const&)   = delete;
+  void operator=(LavaFrameMap const&) = delete;
+
+  Shard&    shard(Key const& k){ return m_shards[ KeyHash()(k) % SHARDS ]; }
+  Entry*    alloc(Shard& sh)                                              // needs the shard lock to be held
+  {
+    Entry* e = nullptr;
+    if(sh.pool.size() > 0){
+      e = sh.pool.back();
+      sh.pool.pop_back();
+    }else{ e = new Entry(); }
+
+    e->frm      = LavaFrame();
+    e->nxt      = nullptr;
+    e->filled   = 0;
+    return e;
+  }
+  LavaFrame*  put(LavaPacket const& pkt, u16 slots)                       // returns the completed frame if this packet filled its last slot, otherwise nullptr - a returned frame must be given back with release()
+  {
+    Key     k = { pkt.dest_node, pkt.cycle };
+    Shard& sh = shard(k);
+    u16  sIdx = pkt.dest_slot;
+
+    Entry* e = nullptr;
+    sh.lock();
+      SECTION(find the first frame for this key with an open slot for the packet or chain a new frame on the end)
+      {
+        auto it = sh.map.find(k);
+        Entry*  prev = nullptr;
+        Entry*   cur = it!=sh.map.end()?  it->second  :  nullptr;
+        for(; cur; prev=cur, cur=cur->nxt){
+          if( cur->frm.slotMask.trySet(sIdx) ){ e = cur; break; }
+        }
+        if(!e){
+          e = alloc(sh);
+          e->frm.dest   =  pkt.dest_node;
+          e->frm.cycle  =  pkt.cycle;
+          e->frm.slots  =  slots;
+          e->frm.slotMask.trySet(sIdx);
+          if(prev) prev->nxt = e;
+          else     sh.map[k] = e;
+        }
+        e->frm.takeOrder(pkt);                                             // under the lock since every packet of the frame changes them
+      }
+      if( e->frm.slotMask.count() >= e->frm.slots ) SECTION(every slot is claimed so unlink the frame and no other thread can find it)
+      {
+        auto it = sh.map.find(k);
+        if(it->second == e){
+          if(e->nxt) it->second = e->nxt;
+          else       sh.map.erase(it);
+        }else{
+          Entry* prev = it->second;
+          while(prev->nxt != e){ prev = prev->nxt; }
+          prev->nxt = e->nxt;
+        }
+        e->nxt = nullptr;
+      }
+    sh.unlock();
+
+    e->frm.packets[sIdx] = pkt;
+    u32 filled = ((au32*)&e->filled)->fetch_add(1, std::memory_order_acq_rel) + 1;
+    return filled >= e->frm.slots?  &e->frm  :  nullptr;
+  }
+  void    release(LavaFrame* frm)
+  {
+    Entry* e = (Entry*)frm;                                                // frm is the first member of Entry
+    Key    k = { e->frm.dest, e->frm.cycle };
+    Shard& sh = shard(k);
+    sh.lock();
+      sh.pool.push_back(e);
+    sh.unlock();
+  }
+  void      clear(){ clear([](LavaFramePacket const&){}); }
+  template<class FUNC> void clear(FUNC const& f)                          // returns every partial frame to its pool after calling f on each of its packets - only safe when no LavaLoop threads are putting packets
+  {
+    for(auto& sh : m_shards){
+      sh.lock();
+        for(auto& kv : sh.map){
+          for(Entry* e = kv.second; e; ){
+            Entry* nxt = e->nxt;
+            TO(LavaFrame::PACKET_SLOTS,i) if(e->frm.slotMask[i]){ f(e->frm.packets[i]); }
+            sh.pool.push_back(e);
+            e = nxt;
+          }
+        }
+        sh.map.clear();
+      sh.unlock();
+    }
+  }
+  template<class FUNC> u64 dropCycle(u64 cycle, FUNC const& f)            // returns every partial frame of a cycle to its pool after calling f on each of its packets - only safe once no more packets of the cycle can arrive
+  {
+    u64 cnt = 0;
+    for(auto& sh : m_shards){
+      sh.lock();
+        for(auto it = sh.map.begin(); it != sh.map.end(); ){
+          if(it->first.cycle != cycle){ ++it; continue; }
+
+          for(Entry* e = it->second; e; ){
+            Entry* nxt = e->nxt;
+            TO(LavaFrame::PACKET_SLOTS,i) if(e->frm.slotMask[i]){ f(e->frm.packets[i]); ++cnt; }
+            sh.pool.push_back(e);
+            e = nxt;
+          }
+          it = sh.map.erase(it);
+        }
+      sh.unlock();
+    }
+    return cnt;
+  }
+  u64        size()
+  {
+    u64 cnt = 0;
+    for(auto& sh : m_shards){
+      sh.lock();
+        for(auto& kv : sh.map){
+          for(Entry* e = kv.second; e; e = e->nxt){ ++cnt; }
+        }
+      sh.unlock();
+    }
+    return cnt;
+  }
+};
+struct   LavaBackoff
+{
+// what a LavaLoop thread does when it finds no packets and no generator gives it output
+// Design: the first 'spins' idle loops go straight back to polling, the next 'yields' loops yield the thread, and after that the thread parks on a condition variable until putPacket wakes it or parkUs passes
+// Parking has a timeout because generators make data on their own and still need to be polled while the flow is idle
+// The counters are shared by every thread of a LavaFlow and can be read at any time
+
+  using       au64 = std::atomic<uint64_t>;
+  using  TimePoint = std::chrono::steady_clock::time_point;
+
+  struct Streak                                                          // per thread state for the current run of idle loops
+  {
+    u64          loops = 0;
+    TimePoint       st;
+  };
+
+  u64          spins = 512;                                              // idle loops that poll again right away
+  u64         yields = 64;                                               // idle loops that yield the thread before parking
+  u64         parkUs = 1000;                                             // longest a thread stays parked before polling the generators again - 0 means never park and keep yielding
+
+  au64        spinNs = 0;                                                // time spent spinning or yielding while idle
+  au64        parkNs = 0;                                                // time spent parked
+  au64         parks = 0;                                                // number of times a thread parked
+  au64         wakes = 0;                                                // number of times putPacket woke a parked thread
+
+  void clearCounters(){ spinNs=0; parkNs=0; parks=0; wakes=0; }
+};
+class  simdb;
+
+struct      LavaHist
+{
+// HDR style histogram - every power of two is split into SUB linear buckets so any recorded value is within 1/SUB of its bucket's lower bound
+// Values below SUB get their own buckets, so the whole u64 range fits in a fixed BUCKETS counts
+// All counts are atomic so any thread can record while another reads
+
+  using  au64 = std::atomic<uint64_t>;
+
+  static const u64 SUB_BITS = 3;
+  static const u64      SUB = 1 << SUB_BITS;
+  static const u64  BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+  std::array<au64, BUCKETS>  counts;
+  au64        total = 0;
+  au64          sum = 0;
+  au64           mx = 0;
+
+  LavaHist(){ clear(); }
+
+  static u64     idx(u64 v)
+  {
+    if(v < SUB){ return v; }
+
+    u64    e  =  msb64(v);
+    u64 mant  =  (v >> (e - SUB_BITS)) & (SUB - 1);
+    return (e - SUB_BITS + 1)*SUB + mant;
+  }
+  static u64   lower(u64 i)                                              // the lowest value that goes in bucket i
+  {
+    if(i < SUB){ return i; }
+
+    u64    e  =  i/SUB - 1 + SUB_BITS;
+    u64 mant  =  i % SUB;
+    return (SUB + mant) << (e - SUB_BITS);
+  }
+
+  void    record(u64 v)
+  {
+    counts[idx(v)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(v, std::memory_order_relaxed);
+
+    u64 prev = mx.load(std::memory_order_relaxed);
+    while(v > prev && !mx.compare_exchange_weak(prev, v, std::memory_order_relaxed)){}
+  }
+  u64 percentile(f64 p) const                                            // p is from 0 to 1 - returns the lower bound of the bucket the percentile falls in
+  {
+    u64 cnt = total.load();
+    if(cnt == 0){ return 0; }
+
+    u64 target = (u64)(p * cnt);
+    if(target >= cnt){ target = cnt - 1; }
+
+    u64 acc = 0;
+    TO(BUCKETS,i){
+      acc += counts[i].load(std::memory_order_relaxed);
+      if(acc > target){ return lower(i); }
+    }
+    return mx.load();
+  }
+  u64      count() const { return total.load(); }
+  u64        max() const { return mx.load(); }
+  f64       mean() const
+  {
+    u64 cnt = total.load();
+    return cnt? sum.load() / (f64)cnt  :  0.0;
+  }
+  void     clear()
+  {
+    for(auto& c : counts){ c.store(0); }
+    total = 0;
+    sum   = 0;
+    mx    = 0;
+  }
+};
+struct  LavaNodeProf
+{
+  using  au64 = std::atomic<uint64_t>;
+
+  au64       calls = 0;
+  au64      errors = 0;
+  LavaHist    time;                                                      // nanoseconds spent in each call of the node function
+  LavaHist    wait;                                                      // nanoseconds from a packet being put in the queue to it being taken out for this node
+  LavaHist   bytes;                                                      // sz_bytes of every packet the node outputs
+
+  void clear(){ calls=0; errors=0; time.clear(); wait.clear(); bytes.clear(); }
+};
+struct  LavaPrioProf
+{
+  using  au64 = std::atomic<uint64_t>;
+
+  au64     packets = 0;                                                  // packets of this priority taken out of the queues
+  au64    deadline = 0;                                                  // how many of them had a deadline
+  au64      missed = 0;                                                  // how many of those were taken out after their deadline
+  LavaHist    wait;                                                      // nanoseconds from a packet being put in the queue to it being taken out
+  LavaHist    late;                                                      // nanoseconds past the deadline of each packet that missed it
+
+  void  take(u64 now, LavaPacket const& pkt)                             // pkt.id is the time it was put in the queue when profiling
+  {
+    packets.fetch_add(1, std::memory_order_relaxed);
+    if(pkt.id && now > pkt.id){ wait.record(now - pkt.id); }
+    if(pkt.deadline){
+      deadline.fetch_add(1, std::memory_order_relaxed);
+      if(now > pkt.deadline){
+        missed.fetch_add(1, std::memory_order_relaxed);
+        late.record(now - pkt.deadline);
+      }
+    }
+  }
+  void clear(){ packets=0; deadline=0; missed=0; wait.clear(); late.clear(); }
+};
+struct  LavaProfiler
+{
+// per node statistics recorded by LavaLoop while 'on' is true and published as a tbl into a simdb key every publishMs
+// Design: each node's LavaNodeProf is made once and never freed while the flow exists, so LavaLoop threads can keep their own map of node id to LavaNodeProf* and only take m_lck the first time they see a node
+// Publishing is done by whichever LavaLoop thread first sees that the publish time has passed, so the other threads never wait on it and readers in other processes only touch simdb
+
+  using      au64 = std::atomic<uint64_t>;
+  using   ProfPtr = std::unique_ptr<LavaNodeProf>;
+  using   ProfMap = std::unordered_map<uint64_t, ProfPtr>;
+  using   PrioPtr = std::unique_ptr<LavaPrioProf>;
+  using  PrioProfs = std::array<PrioPtr, 256>;
+
+  bool              on = false;                                          // set before start() - adds two clock reads and a few atomic increments per node call
+  u64        publishMs = 500;
+  simdb*            db = nullptr;                                        // if this is null the stats are recorded but not published
+  str              key = "lava profile";
+
+  std::mutex     m_lck;
+  ProfMap      m_nodes;
+  PrioProfs    m_prios;                                                  // made the first time a packet of each priority is taken, so flows that never set a priority have only one
+  au64   m_nxtPublish = 0;
+
+  static u64      nowNs()
+  {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>( steady_clock::now().time_since_epoch() ).count();
+  }
+
+  LavaNodeProf*  node(u64 nid)
+  {
+    std::lock_guard<std::mutex> lck(m_lck);
+    ProfPtr& p = m_nodes[nid];
+    if(!p){ p = ProfPtr(new LavaNodeProf()); }
+    return p.get();
+  }
+  LavaPrioProf*  prio(u64 priority)
+  {
+    std::lock_guard<std::mutex> lck(m_lck);
+    PrioPtr& p = m_prios[priority & 255];
+    if(!p){ p = PrioPtr(new LavaPrioProf()); }
+    return p.get();
+  }
+  bool         due()                                                     // returns true for only one thread once the publish time has passed
+  {
+    if(!db){ return false; }
+
+    u64  now = nowNs();
+    u64  nxt = m_nxtPublish.load(std::memory_order_relaxed);
+    if(now < nxt){ return false; }
+
+    return m_nxtPublish.compare_exchange_strong(nxt, now + publishMs*1000000);
+  }
+  void       reset()                                                     // zeroes the stats instead of freeing them so it is safe while LavaLoop threads are running
+  {
+    std::lock_guard<std::mutex> lck(m_lck);
+    for(auto& kv : m_nodes){ kv.second->clear(); }
+    for(auto& p : m_prios){ if(p){ p->clear(); } }
+  }
+};
+struct  LavaEdgeStat
+{
+  using  au64 = std::atomic<uint64_t>;
+
+  au64         key = 0;                                                  // the destination slot as a LavaId with isIn set, so it is never 0 - 0 is an unused entry
+  au64     packets = 0;                                                  // packets routed to the slot that no thread has taken out of the queues yet
+  au64       bytes = 0;                                                  // sz_bytes of those packets
+  au64 peakPackets = 0;
+  au64   peakBytes = 0;
+  au64       skips = 0;                                                  // times a generator feeding this slot was skipped because the slot was full
+
+  void clear(){ packets=0; bytes=0; peakPackets=0; peakBytes=0; skips=0; }
+};
+struct  LavaEdges
+{
+// queue depth and bytes in flight for every destination slot, and the limits that keep generators from outrunning the nodes they feed
+// Design: the stats are an open addressed table keyed by destination slot - entries are claimed with a compare exchange and never removed while threads are in LavaLoop, so they look them up without a lock
+// Once no thread is left in LavaLoop, reset() drops every entry so the slots of deleted nodes are reclaimed, and the table grows to twice the destination slots of the graph
+// A packet is counted when it is routed and uncounted when a LavaLoop thread takes it out of a queue, so packets waiting in frames for their other inputs are not counted
+// nxtMsgId() skips a generator while any slot it feeds is at a limit - limits only stop generators, packets from other nodes are always routed so the graph can drain
+// The limit is checked before a generator runs, so a slot can go over it by the outputs of the generator calls that were already running
+
+  static const u64 SLOTS = 4096;                                         // power of 2 - the smallest table, slots past the size of the table are not counted
+
+  bool              on = false;                                          // set before start() - adds two atomic adds per packet, a limit turns it on as well
+  u64       maxPackets = 0;                                              // 0 is no limit
+  u64         maxBytes = 0;                                              // 0 is no limit
+
+  std::unique_ptr<LavaEdgeStat[]> m_stats;
+  u64                             m_slots = SLOTS;                       // power of 2
+  u64                              m_bits = 12;                          // log2 of m_slots
+  std::atomic<bool>                m_full = false;                       // set the first time a slot finds the table full, so that is only printed once
+
+  LavaEdges() : m_stats(new LavaEdgeStat[SLOTS]) {}
+
+  static u64       keyOf(LavaId dest){ return LavaId(dest.nid, dest.sidx, 1).asInt; }
+  u64               slot(u64 key) const { return (key * 0x9E3779B97F4A7C15ull) >> (64 - m_bits); }   // the top bits of a fibonacci hash, one for each entry of the table
+
+  bool          counting() const { return on || maxPackets || maxBytes; }
+  bool           limited() const { return maxPackets || maxBytes; }
+
+  LavaEdgeStat*     stat(LavaId dest)                                    // finds or claims the entry for a destination slot, returns null if the table is full
+  {
+    u64 key = keyOf(dest);
+    u64  st = slot(key);
+    TO(m_slots,i){
+      LavaEdgeStat& s = m_stats[ (st+i) & (m_slots-1) ];
+      u64 k = s.key.load();
+      if(k == key){ return &s; }
+      if(k == 0){
+        if( s.key.compare_exchange_strong(k, key) || k == key ){ return &s; }
+      }
+    }
+    if( !m_full.exchange(true) ){ printf("\n LavaEdges is full at %llu destination slots, the rest are not counted until the flow is stopped \n", (unsigned long long)m_slots); }
+    return nullptr;
+  }
+  LavaEdgeStat*     find(LavaId dest) const                              // null if nothing was ever routed to dest
+  {
+    u64 key = keyOf(dest);
+    u64  st = slot(key);
+    TO(m_slots,i){
+      LavaEdgeStat& s = m_stats[ (st+i) & (m_slots-1) ];
+      u64 k = s.key.load();
+      if(k == key){ return &s; }
+      if(k == 0){   return nullptr; }
+    }
+    return nullptr;
+  }
+  void               put(LavaPacket const& pkt)                          // a packet was routed to its destination slot
+  {
+    LavaEdgeStat* s = stat( LavaId(pkt.dest_node, pkt.dest_slot) );
+    if(!s){ return; }
+
+    u64 p = s->packets.fetch_add(1) + 1;
+    u64 b = s->bytes.fetch_add(pkt.sz_bytes) + pkt.sz_bytes;
+    u64 pp = s->peakPackets.load(std::memory_order_relaxed);
+    while(p > pp && !s->peakPackets.compare_exchange_weak(pp, p, std::memory_order_relaxed)){}
+    u64 pb = s->peakBytes.load(std::memory_order_relaxed);
+    while(b > pb && !s->peakBytes.compare_exchange_weak(pb, b, std::memory_order_relaxed)){}
+  }
+  void              take(LavaPacket const& pkt)                          // a LavaLoop thread took a packet out of a queue - ranges of a split packet were never counted
+  {
+    if(pkt.split){ return; }
+
+    LavaEdgeStat* s = find( LavaId(pkt.dest_node, pkt.dest_slot) );
+    if(!s){ return; }
+
+    s->packets.fetch_sub(1);
+    s->bytes.fetch_sub(pkt.sz_bytes);
+  }
+  bool              full(LavaId const* dst, LavaId const* dstEn) const   // true if any of the destination slots is at a limit
+  {
+    for(; dst != dstEn; ++dst){
+      LavaEdgeStat* s = find(*dst);
+      if(!s){ continue; }
+      if( (maxPackets && s->packets.load() >= maxPackets) ||
+          (maxBytes   && s->bytes.load()   >= maxBytes)   ){
+        s->skips.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+  void               fit(u64 dests)                                      // grows the table to twice dests, dropping every entry - only when no LavaLoop thread is running
+  {
+    u64 bits = 12;
+    while( (1ull<<bits) < dests*2 ){ ++bits; }
+    if(bits <= m_bits){ return; }
+
+    m_stats.reset(new LavaEdgeStat[1ull<<bits]);
+    m_slots = 1ull << bits;
+    m_bits  = bits;
+    m_full  = false;
+  }
+  void             reset(u64 dests)                                      // drops every entry after the queues have been emptied so the slots of deleted nodes are reclaimed, then fits the table to dests - only when no LavaLoop thread is running
+  {
+    TO(m_slots,i){
+      m_stats[i].key = 0;
+      m_stats[i].clear();
+    }
+    m_full = false;
+    fit(dests);
+  }
+};
+struct  LavaCycles
+{
+// the window of cycles in flight and the count of unfinished work in each, so cycle N+1 can start before cycle N drains without letting cycles run away
+// Design: a cycle is one call of every generator - generator calls are handed out in cycle order under a lock and a new cycle only opens while fewer than window cycles are unfinished
+// Each cycle's entry in a ring counts its generator calls that have not finished plus its packets that have not been run - a cycle opens at the number of generators, every routed packet adds one and every finished call or packet subtracts one once its outputs are routed, so zero means the cycle is done
+// Packets waiting in a frame for their other inputs are not work - they are counted in parked, and a frame that has not filled when its cycle is done never will, so the cycle is put on the dead list for LavaLoop to drop those frames
+// Cycles finish in any order but done only moves past the oldest unfinished one, which is what the window is measured from
+// Packets put in the queue from outside a LavaLoop thread are not counted, so the window is off by default - set it only when generators on LavaLoop threads feed the whole flow
+
+  using   au64 = std::atomic<u64>;
+  using   ai64 = std::atomic<i64>;
+  using  abool = std::atomic<bool>;
+  using  Mutex = std::mutex;
+  using   u64s = std::vector<u64>;
+
+  static const u64 RING = 64;                                            // most cycles that can be in flight at once
+
+  struct alignas(64) Cycle
+  {
+    ai64     work = 0;                                                   // generator calls and packets of the cycle that have not finished
+    ai64   parked = 0;                                                   // packets of the cycle waiting in frames
+  };
+  struct        Hold                                                     // the work a LavaLoop iteration took, finished when the iteration ends, including on its continue paths
+  {
+    LavaCycles*  cy;
+    u64       cycle = 0;
+    u64           n = 0;
+
+    Hold(LavaCycles& _cy) : cy(&_cy) {}
+    ~Hold(){ release(); }
+
+    void     set(u64 c, u64 cnt){ cycle = c; n = cnt; }
+    void release(){ if(n){ cy->finish(cycle, n); n = 0; } }
+  };
+
+  u64          window = 0;                                               // set before start() - cycles that can be in flight at once, up to RING - 0, the default, turns the window off and every packet stays in cycle 0
+
+  Mutex         m_lck;
+  u64          m_open = 0;                                               // the newest cycle that generator calls are handed out from
+  u64          m_gens = 0;                                               // generator calls in m_open, fixed when it opened
+  u64           m_gen = 0;                                               // generator calls of m_open handed out so far
+  au64         m_done = 0;                                               // the oldest cycle that has not finished - every cycle before it is done
+  abool     m_hasDead = false;
+  u64s         m_dead;                                                   // finished cycles that left frames that never filled
+  std::array<Cycle, RING>  m_ring;
+
+  bool         on() const { return window > 0; }
+  u64        span() const { return window < RING?  window  :  RING; }
+  Cycle&    entry(u64 c){ return m_ring[c % RING]; }
+  u64        done() const { return m_done.load(); }                      // cycles that have finished
+  u64      opened()                                                      // cycles that have started
+  {
+    std::lock_guard<Mutex> lck(m_lck);
+    return m_gens? m_open+1 : 0;
+  }
+
+  void      reset()                                                      // only when no LavaLoop threads are running
+  {
+    std::lock_guard<Mutex> lck(m_lck);
+    m_open = m_gens = m_gen = 0;
+    m_done = 0;
+    m_dead.clear();
+    m_hasDead = false;
+    for(auto& c : m_ring){ c.work = 0; c.parked = 0; }
+  }
+  bool      claim(u64 gens, u64* out_cycle, u64* out_idx)                // hands out the next generator call in cycle order - false if the window is full
+  {
+    std::lock_guard<Mutex> lck(m_lck);
+    if(m_gen >= m_gens) SECTION(the open cycle has handed out all its calls so open the next one if the window has room)
+    {
+      if(gens == 0){ return false; }
+      u64 nxt = m_gens? m_open+1 : 0;                                    // m_gens is only 0 before the first cycle opens
+      if(nxt >= m_done.load() + span()){ return false; }
+
+      entry(nxt).work   = (i64)gens;                                     // the entry's last cycle is at least RING cycles older and done, so nothing else touches it
+      entry(nxt).parked = 0;
+      m_open = nxt;
+      m_gens = gens;
+      m_gen  = 0;
+    }
+    *out_cycle = m_open;
+    *out_idx   = m_gen++;
+    return true;
+  }
+  void        add(u64 c, u64 n){ if(n){ entry(c).work.fetch_add((i64)n); } }
+  void       park(u64 c, i64 n){ entry(c).parked.fetch_add(n); }
+  void     finish(u64 c, u64 n)
+  {
+    if( entry(c).work.fetch_sub((i64)n) != (i64)n ){ return; }
+
+    std::lock_guard<Mutex> lck(m_lck);                                   // this took the cycle to zero, so move done past every finished cycle
+    u64 d = m_done.load();
+    for(; m_gens && d<=m_open && entry(d).work.load()==0; ++d){
+      if(entry(d).parked.exchange(0) != 0){
+        m_dead.push_back(d);
+        m_hasDead = true;
+      }
+    }
+    m_done = d;
+  }
+  bool    hasDead() const { return m_hasDead.load(std::memory_order_relaxed); }
+  u64s   takeDead()
+  {
+    std::lock_guard<Mutex> lck(m_lck);
+    u64s dead;
+    dead.swap(m_dead);
+    m_hasDead = false;
+    return dead;
+  }
+};
+struct  LavaNodeLocks
+{
+// the running flag of every exclusive or pinned node, so a LavaLoop thread can skip a node another thread is running instead of waiting on it
+// Design: a fixed open addressed table keyed by node id like LavaEdges - entries are claimed with a compare exchange and never removed, so the flag is shared by both graph buffers and outlives a node being swapped for a new version
+// A pinned node's entry also holds the token of the thread it belongs to - the first thread to run it takes it, and gives it up when it leaves LavaLoop so another thread can take it over
+// Nodes that find the table full share one overflow entry, so they still never run on two threads at once - they just also wait on each other
+
+  using   au64 = std::atomic<u64>;
+
+  static const u64 SLOTS = 4096;                                         // power of 2 - nodes past this many share m_overflow
+
+  struct  Entry
+  {
+    au64      key = 0;                                                   // node id plus one, so 0 is an unused entry
+    au64  running = 0;                                                   // token of the thread running the node, 0 when no thread is
+    au64    owner = 0;                                                   // token of the thread a pinned node belongs to, 0 when it has none
+  };
+  struct  Guard                                                          // releases the node a LavaLoop iteration holds, including on its continue paths
+  {
+    LavaNodeLocks*  nl;
+    Entry*           e = nullptr;
+
+    Guard(LavaNodeLocks& _nl) : nl(&_nl) {}
+    ~Guard(){ release(); }
+
+    void release(){ if(e){ e->running.store(0, std::memory_order_release); e = nullptr; } }
+  };
+
+  std::unique_ptr<Entry[]> m_entries;
+  Entry                    m_overflow;                                   // the running flag and owner of every node that did not get its own entry
+  au64                     m_tokens = 0;
+  std::atomic<bool>        m_full   = false;                             // set the first time a node finds the table full, so that is only printed once
+
+  LavaNodeLocks() : m_entries(new Entry[SLOTS]) {}
+
+  static u64        slot(u64 key){ return (key * 0x9E3779B97F4A7C15ull) >> 52; }
+  static u64        mode(LavaNode const* ln)
+  {
+    if(!ln){ return LavaNode::EXEC_SHARED; }
+    if(ln->exec != LavaNode::EXEC_DEFAULT){ return ln->exec; }
+    return ln->node_type==LavaNode::MSG?  LavaNode::EXEC_EXCLUSIVE  :  LavaNode::EXEC_SHARED;
+  }
+
+  u64              token(){ return m_tokens.fetch_add(1) + 1; }         // a LavaLoop thread takes one when it starts
+  Entry*           entry(u64 nid)                                        // finds or claims the entry for a node, returns the overflow entry if the table is full
+  {
+    u64 key = nid + 1;
+    u64  st = slot(key);
+    TO(SLOTS,i){
+      Entry& e = m_entries[ (st+i) & (SLOTS-1) ];
+      u64 k = e.key.load();
+      if(k == key){ return &e; }
+      if(k == 0){
+        if( e.key.compare_exchange_strong(k, key) || k == key ){ return &e; }
+      }
+    }
+    if( !m_full.exchange(true) ){ printf("\n LavaNodeLocks is full at %llu exclusive and pinned nodes, the rest run one at a time between them \n", (unsigned long long)SLOTS); }
+    return &m_overflow;
+  }
+  bool            tryRun(LavaNode const* ln, u64 nid, u64 tok, Guard* g)   // true if this thread can run the node now - g holds it until released if it is exclusive or pinned
+  {
+    u64 md = mode(ln);
+    if(md == LavaNode::EXEC_SHARED){ return true; }
+
+    Entry* e = entry(nid);
+    if(md == LavaNode::EXEC_PINNED){
+      u64 own = e->owner.load();
+      if(own == 0){ e->owner.compare_exchange_strong(own, tok); }       // takes the node if no thread has it yet - if another thread got there first, own is left holding that thread's token
+      if(own != 0 && own != tok){ return false; }
+    }
+
+    u64 prev = 0;
+    if( e->running.load(std::memory_order_relaxed)!=0 || !e->running.compare_exchange_strong(prev, tok, std::memory_order_acquire) ){ return false; }
+    g->e = e;
+    return true;
+  }
+  void          unpin(u64 tok)                                           // a thread leaving LavaLoop gives up the nodes pinned to it
+  {
+    TO(SLOTS,i){
+      u64 own = tok;
+      m_entries[i].owner.compare_exchange_strong(own, 0);
+    }
+    u64 own = tok;
+    m_overflow.owner.compare_exchange_strong(own, 0);
+  }
+};
+struct  LavaTraceEvent
+{
+  enum Type : u8 { SPAN=0, FLOW_OUT, FLOW_IN };                          // FLOW_OUT is a packet being put into a queue, FLOW_IN is it being taken out
+
+  Type     type;
+  u64       nid;
+  u64     cycle;
+  u64        st;                                                         // nanoseconds
+  u64        en;                                                         // only used by SPAN
+  u64      flow;                                                         // matches a FLOW_OUT to its FLOW_IN
+};
+struct   LavaTraceBuf
+{
+// events recorded by one LavaLoop thread
+// Only the owning thread writes, and it publishes each event by storing the new count with release, so a dump on another thread can read everything below count without a lock
+// The buffer never grows so the events never move - once it is full new events are dropped and counted
+
+  using  au64 = std::atomic<uint64_t>;
+
+  u64                           tid;
+  std::vector<LavaTraceEvent>   evs;
+  au64                        count = 0;
+  au64                      dropped = 0;
+  bool                         free = false;                             // no thread has taken it since LavaTracer::reuse() - only read and written under the tracer's lock
+
+  LavaTraceBuf(u64 _tid, u64 capacity) : tid(_tid), evs(capacity) {}
+
+  void       put(LavaTraceEvent const& e)
+  {
+    u64 cnt = count.load(std::memory_order_relaxed);
+    if(cnt >= evs.size()){ dropped.fetch_add(1, std::memory_order_relaxed); return; }
+
+    evs[cnt] = e;
+    count.store(cnt+1, std::memory_order_release);
+  }
+};
+struct     LavaTracer
+{
+// timeline of node executions and packet hand offs, written as Chrome trace JSON (chrome://tracing or ui.perfetto.dev) by LavaStop or LavaTraceDump
+// Each LavaLoop thread gets its own LavaTraceBuf when it starts, and the buffers are kept until clear() so a dump after the threads exit still has their events
+// LavaFlow::start() calls reuse(), so the threads of the next run write over the same buffers instead of each allocating eventsPerThread events again
+
+  using   BufPtr = std::unique_ptr<LavaTraceBuf>;
+  using     Bufs = std::vector<BufPtr>;
+
+  bool                   on = false;                                     // set before start()
+  u64       eventsPerThread = 1 << 20;
+  str                  path = "lava_trace.json";
+
+  std::mutex          m_lck;
+  Bufs               m_bufs;
+
+  static u64          nowNs()                                            // uses the same clock as the node timing in LavaLoop so spans and packet events line up
+  {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>( high_resolution_clock::now().time_since_epoch() ).count();
   }
-  auto     nodeOutSlots(u64     nid) -> decltype(oppOutSlots().begin())
+  static u64         flowId(LavaPacket const& pkt)                       // the same for the enqueue and dequeue of one packet copy without needing a field in the packet
   {
-    return lower_bound(ALL(oppOutSlots()), nid, [](auto a,auto b){ return a.first.nid < b; } );
+    return pkt.val.value ^ (pkt.dest_node << 40) ^ ((u64)pkt.dest_slot << 32) ^ pkt.cycle;
   }
-  auto          inSlots()  -> Slots& { return curInSlots(); }
-  auto          inSlots() const -> Slots const& { return curInSlots();  }
-  auto       getInSlots() -> Slots& { return curInSlots(); }
-  auto         outSlots() -> Slots& { return curOutSlots(); }
-  auto         outSlots() const -> Slots const& { return curOutSlots();  }
-  auto      getOutSlots() -> Slots& { return curOutSlots(); }
 
-  auto          srcSlot(LavaId destId) -> LavaFlowSlot* 
+  LavaTraceBuf*   threadBuf()
   {
-    auto ci = curCncts().find(destId);
-    if(ci != curCncts().end()){
-      //LavaFlowSlot* s = slot(ci->second);
-      LavaFlowSlot* s = outSlot(ci->second);
-      return s;
-    }else 
-      return nullptr;
+    std::lock_guard<std::mutex> lck(m_lck);
+    for(auto& bp : m_bufs){
+      if(bp->free){ bp->free = false; return bp.get(); }
+    }
+    m_bufs.emplace_back( new LavaTraceBuf(m_bufs.size(), eventsPerThread) );
+    return m_bufs.back().get();
   }
-  auto        destSlots(LavaId  srcId) -> decltype(curDestCncts().find(srcId))
+  void              reuse()                                              // empties every buffer and hands them to the next threads to start - only call when no LavaLoop threads are running
   {
-    return curDestCncts().find(srcId);
+    std::lock_guard<std::mutex> lck(m_lck);
+    for(auto& bp : m_bufs){
+      if(bp->evs.size() != eventsPerThread){ bp->evs.resize(eventsPerThread); }
+      bp->count   = 0;
+      bp->dropped = 0;
+      bp->free    = true;
+    }
   }
-  auto        inSlotEnd() -> decltype(curInSlots().end()) { return curInSlots().end(); }
-  u64           inSltSz() const { return curInSlots().size(); }
-  auto       outSlotEnd() -> decltype(curOutSlots().end()) { return curOutSlots().end(); }
-  u64          outSltSz() const { return curOutSlots().size(); }
-
-  // connection deletion
-  u32     delSrcCncts(LavaId  src)
+  void              clear()                                              // only call when no LavaLoop threads are running
   {
-    u32  cnt = 0;
-    auto  di = oppDestCncts().find(src);
-    for(; di!=oppDestCncts().end() && di->first==src; ++cnt, ++di){   // ++di,
-      oppCncts().erase(di->second);
-    }
-    oppDestCncts().erase(src);
+    std::lock_guard<std::mutex> lck(m_lck);
+    m_bufs.clear();
+  }
+};
+struct   LavaCaptureRec
+{
+// the header of one captured frame - the node name follows padded to 8 bytes, then a LavaCaptureSlot and its padded payload for each filled slot
+  static const u64 MAGIC = 0x3130504143415641;                           // "AVACAP01" read as a little endian u64
+
+  u64       magic = MAGIC;
+  u64         nid = 0;
+  u64       cycle = 0;
+  u32       slots = 0;                                                   // LavaFrame::slots
+  u32      filled = 0;                                                   // how many LavaCaptureSlot records follow
+  u64     nameLen = 0;
+};
+struct   LavaCaptureSlot
+{
+  u64        slot = 0;                                                   // index into LavaFrame::packets
+  u64   dest_slot = 0;                                                   // the input slot of the node, which is not the same as slot for a batch
+  u64    src_node = 0;
+  u64    src_slot = 0;
+  u64  rangeStart = 0;
+  u64    rangeEnd = 0;
+  u64        type = 0;                                                   // LavaVal::type
+  u64       value = 0;                                                   // LavaVal::value when the value is not MEMORY
+  u64   sizeBytes = 0;                                                   // bytes of the MEMORY payload that follow
+};
+struct      LavaCapture
+{
+// writes the input frames of chosen nodes to an append only file, so a node can be rerun on real frames by lava_replay without the rest of the graph
+// Design: each record is built in a buffer owned by the calling LavaLoop thread and written with one fwrite under m_lck, so records from different threads never interleave
+// The payload of a MEMORY value is the bytes of its LavaMem, which are already flat tbl memory, so nothing has to be serialized
 
-    return cnt;
+  using      au64 = std::atomic<uint64_t>;
+  using     bytes = std::vector<u8>;
 
-    //di = m_destCncts.find(src);
-  }
-  bool    delDestCnct(LavaId dest)
-  {
-    auto iter = oppCncts().find(dest);
-    if(iter==oppCncts().end()) return false;
+  std::unordered_set<u64> nodes;                                         // ids of the nodes whose inputs are captured - set before start() and leave empty to capture nothing
+  str                      path = "lava_capture.lcap";
+  u64                  maxBytes = 1ull << 30;                            // frames that would take the file past this are dropped
 
-    auto src = iter->second;
-    oppCncts().erase(dest);
+  std::mutex     m_lck;
+  FILE*            m_f = nullptr;
+  au64         m_bytes = 0;
+  au64        m_frames = 0;
+  au64       m_dropped = 0;
 
-    auto srcIter = oppDestCncts().find(src);
-    for(; srcIter!=end(oppDestCncts()) && srcIter->first==src && srcIter->second==dest; ){
-      auto cpy = srcIter++;
-      oppDestCncts().erase(cpy);
-    }
+  ~LavaCapture(){ close(); }
 
-    return true;
+  bool             on() const { return nodes.size() > 0; }
+  bool            has(u64 nid) const { return nodes.find(nid) != nodes.end(); }
+
+  static void  append(bytes* buf, void const* p, u64 sz)                 // pads to 8 bytes so every header in the file is aligned when the file is read into memory
+  {
+    u64 st = buf->size();
+    buf->resize( st + ((sz + 7) & ~7ull), 0 );
+    if(sz){ memcpy(buf->data() + st, p, sz); }
   }
-  u32         delCnct(LavaId   id)
+  bool            put(LavaFrame const& frm, const char* name, bytes* buf)  // buf is the calling thread's, reused between frames
   {
-    u32 cnt = 0;
-    //LavaFlowSlot* s = this->slot(id);
-    LavaFlowSlot* s =  id.isIn? inSlot(id)  :  outSlot(id);
-    if(!s) return 0;
+    buf->clear();
+
+    LavaCaptureRec rec;
+    rec.nid     = frm.dest;
+    rec.cycle   = frm.cycle;
+    rec.slots   = frm.slots;
+    rec.filled  = (u32)frm.slotCount();
+    rec.nameLen = name? strlen(name) : 0;
+    append(buf, &rec, sizeof(rec));
+    append(buf, name, rec.nameLen);
+
+    TO(LavaFrame::PACKET_SLOTS,i) if(frm.slotMask[i])
+    {
+      LavaFramePacket const& pkt = frm.packets[i];
+      LavaCaptureSlot          cs;
+      cs.slot       = i;
+      cs.dest_slot  = pkt.dest_slot;
+      cs.src_node   = pkt.src_node;
+      cs.src_slot   = pkt.src_slot;
+      cs.rangeStart = pkt.rangeStart;
+      cs.rangeEnd   = pkt.rangeEnd;
+      cs.type       = pkt.val.type;
+
+      void* data = nullptr;
+      if(pkt.val.type==LavaArgType::MEMORY && pkt.val.value){
+        LavaMem lm   = LavaMem::fromDataAddr(pkt.val.value);
+        cs.sizeBytes = lm.sizeBytes();
+        data         = lm.data();
+      }else
+        cs.value     = pkt.val.value;
+
+      append(buf, &cs, sizeof(cs));
+      append(buf, data, cs.sizeBytes);
+    }
 
-    if(s->in){
-      auto iter = oppCncts().find(id);
-      if(iter==oppCncts().end()){ return 0; }
+    std::lock_guard<std::mutex> lck(m_lck);
+    if(m_bytes.load() + buf->size() > maxBytes){ m_dropped.fetch_add(1); return false; }
+    if(!m_f){ m_f = fopen(path.c_str(), "ab"); }
+    if(!m_f){ m_dropped.fetch_add(1); return false; }
 
-      return delCnct(iter->second, iter->first);
-    }else{
-      auto iter = oppDestCncts().find(id);
-      if(iter==oppDestCncts().end()){ return 0; }
+    fwrite(buf->data(), 1, buf->size(), m_f);
+    m_bytes.fetch_add(buf->size());
+    m_frames.fetch_add(1);
+    return true;
+  }
+  void          close()                                                  // the next frame opens the file again and appends to it
+  {
+    std::lock_guard<std::mutex> lck(m_lck);
+    if(m_f){ fclose(m_f); m_f = nullptr; }
+  }
+};
+struct   LavaLibWatch
+{
+// tells RefreshFlowLibs when a shared library directory has changed, so the directory is only walked and its write times compared after something was written to it
+// Design: inotify on linux, where only a lava_ library being closed after a write or moved into the directory counts, and a change notification handle on windows, which fires for any write so the write time comparison still decides what is reloaded
+// If the watch could not be set up, changed() is always true and refreshing polls the directory like it did before
+// A change stays pending until done() is called, so a library that could not be copied or loaded yet is tried again on the next refresh instead of waiting for another write
+
+  str           dir;
+  bool      pending = false;
+  #if defined(_WIN32)
+    HANDLE     hndl = INVALID_HANDLE_VALUE;
+  #elif defined(__linux__)
+    int          fd = -1;
+  #endif
 
-      auto  idx = iter->first;
-      while(iter != oppDestCncts().end() && iter->first == idx){
-        oppCncts().erase(iter->second);
-        iter = oppDestCncts().erase(iter);
-        ++cnt;
-      }
-    }
+  LavaLibWatch(){}
+  ~LavaLibWatch(){ close(); }
+  LavaLibWatch(LavaLibWatch const&)   = delete;
+  void operator=(LavaLibWatch const&) = delete;
 
-    return cnt;
+  bool     watching() const
+  {
+    #if defined(_WIN32)
+      return hndl != INVALID_HANDLE_VALUE;
+    #elif defined(__linux__)
+      return fd != -1;
+    #else
+      return false;
+    #endif
   }
-
-  // connection reading
-  auto      destCncts(LavaId  src) -> decltype(curDestCncts().begin()) // C++14 -> decltype(m_slots.find(Id(nid)))
+  bool        watch(str const& path)                                     // stops watching the last directory first
   {
-    return lower_bound(ALL(curDestCncts()), LavaId(src), [](auto a,auto b){ return a.first < b; } );
+    close();
+    dir = path;
+    #if defined(_WIN32)
+      hndl = FindFirstChangeNotificationA(path.c_str(), FALSE, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE);
+    #elif defined(__linux__)
+      fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if(fd != -1 && inotify_add_watch(fd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1){ close(); }
+    #endif
+    return watching();
   }
-  u64   destCnctCount(LavaId  src)
+  bool      changed()                                                    // true if the directory changed since the last call to done() - never blocks
   {
-    return curDestCncts().count(src);
+    if( events() ){ pending = true; }
+    return pending;
   }
-  auto    destCnctEnd() -> decltype(curDestCncts().end()) { return curDestCncts().end(); }
-  auto        cnctEnd() -> decltype(curCncts().end())     { return curCncts().end(); }
-  auto      cnctBegin() -> decltype(curCncts().begin())   { return curCncts().begin(); }
-  auto          cncts() -> CnctMap& { return curCncts(); }
-  auto          cncts() const -> CnctMap const& { return curCncts(); }
-  u64          cnctsz() const { return curCncts().size(); }
-  auto    srcCnctsMap() -> SrcMap&
+  void         done(){ pending = false; }                                // every change seen so far has been refreshed
+  bool       events()                                                    // true if there were change events since the last call - reading them clears them
   {
-    return curDestCncts();
+    using namespace std;
+
+    #if defined(_WIN32)
+      if(hndl == INVALID_HANDLE_VALUE){ return true; }
+      if(WaitForSingleObject(hndl, 0) != WAIT_OBJECT_0){ return false; }
+      FindNextChangeNotification(hndl);                                  // re-arms the handle for the next change
+      return true;
+    #elif defined(__linux__)
+      if(fd == -1){ return true; }
+
+      bool   lib = false;
+      alignas(inotify_event) char buf[4096];
+      for(;;){
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if(len <= 0){ break; }                                           // EAGAIN once every queued event has been read
+
+        for(char* p = buf; p < buf + len; ){
+          auto* ev = (inotify_event*)p;
+          if(ev->len > 0){
+            str name(ev->name);
+            size_t extLen = strlen(libExt);
+            lib = lib || ( name.compare(0, 5, "lava_")==0  &&  name.size() > extLen  &&  name.compare(name.size()-extLen, extLen, libExt)==0 );
+          }
+          if(ev->mask & IN_Q_OVERFLOW){ lib = true; }                    // events were dropped, so refresh in case one of them was a library
+          p += sizeof(inotify_event) + ev->len;
+        }
+      }
+      return lib;
+    #else
+      return true;
+    #endif
+  }
+  void        close()
+  {
+    #if defined(_WIN32)
+      if(hndl != INVALID_HANDLE_VALUE){ FindCloseChangeNotification(hndl); hndl = INVALID_HANDLE_VALUE; }
+    #elif defined(__linux__)
+      if(fd != -1){ ::close(fd); fd = -1; }
+    #endif
   }
 };
 struct       LavaFlow
@@ -1841,14 +3931,18 @@ struct       LavaFlow
 public:
   using abool           =  std::atomic<bool>;
   using au64            =  std::atomic<uint64_t>;
-  using PacketQueue     =  std::priority_queue<LavaPacket>;
-  using FrameQueue      =  std::vector<LavaFrame>;
+  using PacketQueue     =  std::priority_queue<LavaPacket, std::vector<LavaPacket>, LavaPacketOrder>;
   using MsgNodeVec      =  std::vector<uint64_t>;
   using Mutex           =  std::mutex;
+  using CondVar         =  std::condition_variable;
   //using PktCalbk        =  void (*)(LavaPacket pkt);
   using ConstMem        =  std::unordered_map<std::string, LavaConst>;
  
   enum FlowErr { NONE=0, RUN_ERR=0xFFFFFFFFFFFFFFFF };
+  enum   QType { MUTEX_QUEUE=0, MULTI_QUEUE };                        // MUTEX_QUEUE is a single std::priority_queue behind m_qLck with strict ordering, MULTI_QUEUE is the relaxed LavaMultiQ that scales with more threads
+  enum   Sched { GLOBAL=0, LOCAL_FIRST };                              // GLOBAL puts every packet in the global queue, LOCAL_FIRST keeps a thread's output in its own LavaStealQ and runs it next
+  using  Order = LavaPacketOrder::Mode;                                // CYCLE_FIRST, PRIORITY_FIRST or DEADLINE_FIRST - with the last two, packets with a priority or deadline skip the LavaStealQs so LOCAL_FIRST threads can't bury them
+  using StealQs = std::array<LavaStealQ, LAVA_MAX_THREADS>;
 
   lava_pathHndlMap           libs;     // libs is libraries - this maps the live path of the shared libary with the OS specific handle that the OS loading function returns
   lava_nidMap                nids;     // nids is node ids  - this maps the name of the node to all of the graph node ids that use it
@@ -1858,21 +3952,39 @@ public:
   lava_nameNodeMap      nameToPtr;     // maps node names to their pointers 
   ConstMem               constMem;
   LavaParams        defaultParams;
+  LavaBackoff             backoff;     // idle policy and counters for the LavaLoop threads - set the policy before calling start()
+  LavaProfiler           profiler;     // per node latency, wait and output size histograms
+  LavaTracer               tracer;     // per thread timeline of node executions and packets
+  LavaCapture             capture;     // input frames of chosen nodes written to a file for lava_replay
+  LavaEdges                 edges;     // packets and bytes queued for each destination slot, and the limits past which generators are skipped
+  LavaLibWatch           libWatch;     // changes to the shared library directory, so RefreshFlowLibs does not walk it on every call
+  LavaCycles               cycles;     // the cycles in flight and how much of each is unfinished - set cycles.window before start()
+  LavaNodeLocks         nodeLocks;     // running flags of exclusive and pinned nodes, so threads skip a node that is already running instead of racing on its state
+  u64                  splitBytes = 1<<20;   // input packets at least this large are split into ranges for nodes that have a split function
+  u64                 splitRanges = 0;       // how many ranges a split packet is cut into - 0 is one for each running LavaLoop thread
 
 //  mutable bool          m_running = false;            // todo: make this atomic
   mutable abool         m_running = false;            // todo: make this atomic
   mutable u64          m_curMsgId = 0;                // todo: make this atomic
-  mutable u64             m_cycle = 0;                // todo: make this atomic
   mutable LavaId          m_curId = LavaNode::NONE;   // todo: make this atomic - won't be used as a single variable anyway
   mutable u64       m_threadCount = 0;                // todo: make this atomic
   mutable u32             version = 0;                // todo: make this atomic
   mutable Mutex            m_qLck;
-  mutable Mutex       m_frameQLck;
+  mutable Mutex         m_stopLck;
   //mutable PktCalbk packetCallback;
   mutable PacketCallback packetCallback;
   mutable PacketQueue           q;
-  mutable FrameQueue       frameQ;
+  mutable LavaFrameMap     frames;                // frames for nodes with more than one input that are waiting for the rest of their packets
   mutable au64         m_nxtMsgNd = 0;
+  const QType              m_qType;
+  const Sched              m_sched;
+  const LavaPacketOrder    m_order;
+  mutable au64            m_urgent = 0;              // packets with a priority or deadline in the global queue when the order is not CYCLE_FIRST, so LOCAL_FIRST threads look there before their own deques
+  mutable LavaMultiQ           m_mq;
+  mutable StealQs         m_stealQs;
+  mutable Mutex           m_parkLck;
+  mutable CondVar          m_parkCv;
+  mutable au64             m_parked = 0;              // number of threads parked on m_parkCv, so that putPacket only takes m_parkLck when there is a thread to wake
 
   MsgNodeVec          m_genNodesA;
   LavaGraph                 graph;
@@ -1892,17 +4004,50 @@ public:
   {
     return m_nxtMsgNd.fetch_add(1);
   }
-  u64            nxtMsgId()
+  u64            nxtMsgId(u64* out_cycle, u64 tok, LavaNodeLocks::Guard* g)   // returns NODE_NONE if every generator is running on another thread, feeding a slot that is at its edge limit, or the cycle window is full - a returned generator call has to be finished with cycles.finish(*out_cycle, 1) and g holds it if it is exclusive
   {
     auto&  cur = graph.curMsgCache();
-    u64     id = LavaId::NODE_NONE;
-    if(cur.size()>0){
-      u64 idx = fetchIncNxtMsg() % cur.size();
-      return cur[idx].nid;
+    *out_cycle = 0;
+    TO(cur.size(),i){                                                 // only goes past the first generator when one is skipped
+      u64 idx = 0;
+      if(!cycles.on()){ idx = fetchIncNxtMsg(); }
+      else if( !cycles.claim(cur.size(), out_cycle, &idx) ){ break; }
+
+      u64  nid = cur[idx % cur.size()].nid;
+      bool  ok = true;
+      if(edges.limited()){
+        auto dst = graph.routes().node(nid);
+        ok = !edges.full(dst.first, dst.second);
+      }
+      if( ok && nodeLocks.tryRun(graph.node(nid).node, nid, tok, g) ){ return nid; }
+
+      if(cycles.on()){ cycles.finish(*out_cycle, 1); }               // the skipped call is part of its cycle, so it finishes without running
     }
     return LavaId::NODE_NONE;
   }
 
+  u32        claimStealQ()                                          // returns LAVA_MAX_THREADS if every deque is already owned, in which case the thread only uses the global queue
+  {
+    TO(LAVA_MAX_THREADS,i){
+      bool prev = false;
+      if( m_stealQs[i].inUse.compare_exchange_strong(prev, true) ){ return (u32)i; }
+    }
+    return LAVA_MAX_THREADS;
+  }
+  void     releaseStealQ(u32 idx)                                      // any packets left in the deque stay there to be stolen or picked up by the next thread that claims it
+  {
+    if(idx < LAVA_MAX_THREADS){ m_stealQs[idx].inUse.store(false); }
+  }
+  bool       stealPacket(u32 thrdIdx, LavaPacket* outPkt)
+  {
+    u32 st = thrdIdx < LAVA_MAX_THREADS?  thrdIdx+1  :  0;
+    TO(LAVA_MAX_THREADS,i){
+      auto& sq = m_stealQs[ (st+i) % LAVA_MAX_THREADS ];
+      if( sq.steal(outPkt) ){ return true; }
+    }
+    return false;
+  }
+
   u64      incThreadCount()
   {
     return std::atomic_fetch_add( (au64*)&m_threadCount,  1);
@@ -1919,6 +4064,13 @@ public:
     // does each node's slot need its own queue? should packets be organized differently? one queue per frame? what determines a frame? one pass through all the message nodes?
     bool packetWritten = false;
 
+    if(m_qType == MULTI_QUEUE){
+      packetWritten = m_mq.pop(outPkt);
+      if(packetWritten){ m_curId = outPkt->dest_node; }
+      if(packetWritten && urgent(*outPkt)){ m_urgent.fetch_sub(1); }
+      return packetWritten;
+    }
+
     m_qLck.lock();             // lock mutex
       if(q.size() > 0){
         *outPkt = q.top();
@@ -1927,19 +4079,95 @@ public:
         m_curId = outPkt->dest_node;
       }
     m_qLck.unlock();           // unlock mutex
+    if(packetWritten && urgent(*outPkt)){ m_urgent.fetch_sub(1); }
 
     return packetWritten;
 
     //lock_guard<Mutex> qLck(m_qLck);
     //LavaPacket pckt = q.top();
   }
+  bool          nxtPacket(LavaPacket* outPkt, u32 thrdIdx)           // LOCAL_FIRST order - this thread's own newest packet, then the oldest packet stolen from another thread, then the global queue
+  {
+    if(m_sched==LOCAL_FIRST)
+    {
+      if( m_urgent.load(std::memory_order_relaxed) > 0 && nxtPacket(outPkt) ){ return true; }
+
+      if( thrdIdx<LAVA_MAX_THREADS && m_stealQs[thrdIdx].pop(outPkt) ){ m_curId = outPkt->dest_node; return true; }
+      if( stealPacket(thrdIdx, outPkt) ){ m_curId = outPkt->dest_node; return true; }
+    }
+    return nxtPacket(outPkt);
+  }
+  u32            nxtBatch(LavaPacket const& first, LavaPacket* outPkts, u32 mx, u32 thrdIdx)   // takes up to mx more packets for the same node, slot and cycle as first, if they are at the front of the queues - the global queue lock is taken once for the whole batch
+  {
+    using namespace std;
+
+    auto match = [&first](LavaPacket const& p){                       // one cycle per call, so outputs keep the cycle of their inputs and each cycle's work is finished by the call that ran it
+      return p.dest_node==first.dest_node && p.dest_slot==first.dest_slot && p.split==0 && p.cycle==first.cycle;
+    };
+
+    u32 cnt = 0;
+    if(m_sched==LOCAL_FIRST && thrdIdx<LAVA_MAX_THREADS){ cnt += m_stealQs[thrdIdx].popWhile(match, outPkts, mx); }
+    if(cnt >= mx){ return cnt; }
+
+    u32 glbl = cnt;
+    if(m_qType == MULTI_QUEUE){ cnt += m_mq.popWhile(match, outPkts+cnt, mx-cnt); }
+    else{
+      lock_guard<Mutex>  qLck(m_qLck);
+      while(cnt<mx && q.size()>0 && match(q.top())){
+        outPkts[cnt++] = q.top();
+        q.pop();
+      }
+    }
+    for(u32 i=glbl; i<cnt; ++i){ if(urgent(outPkts[i])){ m_urgent.fetch_sub(1); } }
+    return cnt;
+  }
+  bool             urgent(LavaPacket const& pkt) const { return m_order.mode!=LavaPacketOrder::CYCLE_FIRST && (pkt.priority || pkt.deadline); }
+  void     putLocalPacket(LavaPacket     pkt, u32 thrdIdx)
+  {
+    if( m_sched==LOCAL_FIRST && thrdIdx<LAVA_MAX_THREADS && !urgent(pkt) && m_stealQs[thrdIdx].push(pkt) ){ return; }
+    putPacket(pkt);
+  }
   void          putPacket(LavaPacket     pkt)
   {
+    if( urgent(pkt) ){ m_urgent.fetch_add(1); }
+
+    if(m_qType == MULTI_QUEUE){
+      m_mq.push(pkt);
+      if(m_parked.load() > 0){ wakeIdle(); }
+      return;
+    }
+
     m_qLck.lock();              // mutex lock
       //if( packetCallback )
         //packetCallback(pkt);
       q.push(pkt);              // todo: use a mutex here initially
     m_qLck.unlock();            // mutex unlock
+
+    if(m_parked.load() > 0){ wakeIdle(); }
+  }
+
+  bool         peekPacket(LavaPacket* outPkt)                     // copies the next packet out without taking it from the queue, for visualization
+  {
+    using namespace std;
+
+    if(m_qType == MULTI_QUEUE){ return m_mq.peek(outPkt); }
+
+    lock_guard<Mutex>  qLck(m_qLck);
+    if(q.size() == 0){ return false; }
+    *outPkt = q.top();
+    return true;
+  }
+  u64         packetCount()
+  {
+    using namespace std;
+
+    u64 local = 0;
+    for(auto const& sq : m_stealQs){ local += sq.size(); }
+
+    if(m_qType == MULTI_QUEUE){ return m_mq.size() + local; }
+
+    lock_guard<Mutex>  qLck(m_qLck);
+    return q.size() + local;
   }
 
   // query 
@@ -1948,6 +4176,13 @@ public:
     using namespace std;
     
     LavaId ret;
+    LavaPacket pkt;
+    if(m_qType == MULTI_QUEUE){
+      if( m_mq.peek(&pkt) ){ ret.nid = pkt.dest_node; ret.sidx = pkt.dest_slot; }
+      else{                  ret.nid = LavaId::NODE_NONE; ret.sidx = LavaId::SLOT_NONE; }
+      return ret;
+    }
+
     lock_guard<Mutex>  qLck(m_qLck);
       if(q.size() > 0){
         ret.nid  = q.top().dest_node;
@@ -1960,11 +4195,83 @@ public:
     // implicit unlock
   }
 
+  LavaFlow(QType qType=MUTEX_QUEUE, u64 subQueues=0, Sched sched=GLOBAL, Order order=LavaPacketOrder::CYCLE_FIRST) :           // subQueues of 0 with MULTI_QUEUE uses 4 heaps per hardware thread
+    q( LavaPacketOrder(order) ),
+    m_qType(qType),
+    m_sched(sched),
+    m_order(order),
+    m_mq( qType==MULTI_QUEUE?  (subQueues? std::max<u64>(subQueues,2) : std::max<u64>(std::thread::hardware_concurrency(),1)*4)  :  0, LavaPacketOrder(order) )
+  {}
+
   // execution
-  void              start(){ m_running =  true; }
+  void           wakeIdle()
+  {
+    std::lock_guard<Mutex> lck(m_parkLck);               // taking the lock means a thread that is between checking the queue and waiting can't miss the notify
+    m_parkCv.notify_one();
+    backoff.wakes.fetch_add(1);
+  }
+  void            wakeAll()
+  {
+    std::lock_guard<Mutex> lck(m_parkLck);
+    m_parkCv.notify_all();
+  }
+  void           idleWait(LavaBackoff::Streak& s)                  // called by LavaLoop after a loop that had no packet and no generator output
+  {
+    using namespace std::chrono;
+
+    LavaBackoff& b = backoff;
+    if(s.loops == 0){ s.st = steady_clock::now(); }
+    ++s.loops;
+
+    if(s.loops <= b.spins){ return; }
+    if(s.loops <= b.spins+b.yields || b.parkUs==0){ std::this_thread::yield(); return; }
+
+    SECTION(park until a packet is put into the queue or the timeout passes)
+    {
+      auto parkSt = steady_clock::now();
+      b.spinNs.fetch_add( duration_cast<nanoseconds>(parkSt - s.st).count() );
+
+      std::unique_lock<Mutex> lck(m_parkLck);
+        m_parked.fetch_add(1);
+        if(m_running && packetCount()==0){
+          m_parkCv.wait_for(lck, microseconds(b.parkUs));
+        }
+        m_parked.fetch_sub(1);
+      lck.unlock();
+
+      auto parkEn = steady_clock::now();
+      b.parkNs.fetch_add( duration_cast<nanoseconds>(parkEn - parkSt).count() );
+      b.parks.fetch_add(1);
+
+      s.st    = parkEn;
+      s.loops = b.spins + b.yields;                                   // if the next loop is idle too, park again right away after polling the generators once
+    }
+  }
+  void            idleEnd(LavaBackoff::Streak& s)                  // called by LavaLoop when it finds work, to add the time spent spinning to the counters
+  {
+    using namespace std::chrono;
+
+    if(s.loops == 0){ return; }
+
+    backoff.spinNs.fetch_add( duration_cast<nanoseconds>(steady_clock::now() - s.st).count() );
+    s.loops = 0;
+  }
+
+  void              start()
+  {
+    cycles.reset();
+    m_stopLck.lock();
+      if( ((au64*)&m_threadCount)->load() == 0 ){
+        edges.fit( graph.inSltSz() );                  // a graph built since the last stop can have more destination slots than the table - with threads still in LavaLoop it is fitted when the last one leaves
+        tracer.reuse();                                // the last run's events were written by LavaStop, so its buffers go to this run's threads
+      }
+    m_stopLck.unlock();
+    m_running = true;
+  }
   void               stop()
   {
     m_running = false;                                 // this will make the 'running' boolean variable false, which will make the the while(running) loop stop, and the threads will end
+    wakeAll();                                         // parked threads see m_running is false as soon as they wake
     //for(auto& t : fd.flowThreads){
     //  t.join();
     //}
@@ -1978,20 +4285,7 @@ public:
         if(ln->node_type==LavaNode::CONSTANT)
         {
           if(destructConstants){
-            #ifdef _WIN32
-              if(ln->filePtr){
-                UnmapViewOfFile(ln->filePtr);
-              }
-              if(ln->fileHndl){
-                CloseHandle(ln->fileHndl);
-              }
-            #elif defined(__APPLE__) || defined(__MACH__) || defined(__unix__) || defined(__FreeBSD__) || defined(__linux__)     // osx, linux and freebsd
-              if(sm.hndlPtr){
-                munmap(sm.hndlPtr, sm.size);  // todo: size here needs to be the total size, and errors need to be checked
-              }
-              remove(sm.path);
-              // todo: deal with errors here as well
-            #endif
+            LavaConstRelease(ln);                             // the mapping is unmapped once the packets still holding it are dropped
           }
         }else if(ln->destructor){
           ln->destructor();
@@ -2116,6 +4410,18 @@ inline LavaOut       LavaMemToOut(LavaMem lm, u32 slot)
 
   return o;
 }
+inline bool             LavaRange(LavaFrame  const* in, u32 slot, u64 items, u64* out_st, u64* out_en)   // gives the range of items to process from an input that may have been split - returns false and the whole range when it was not split
+{
+  LavaFramePacket const& pkt = in->packets[slot];
+  if(pkt.split == 0){
+    *out_st = 0;
+    *out_en = items;
+    return false;
+  }
+  *out_st = pkt.rangeStart;
+  *out_en = pkt.rangeEnd < items?  pkt.rangeEnd  :  items;
+  return true;
+}
 inline bool           LavaNxtPckt(LavaFrame  const* in, u32* currentIndex)
 {
   while(*currentIndex < in->packets.size()){
@@ -2161,6 +4467,139 @@ inline LavaMem  LavaMemAllocation(LavaAllocFunc  alloc, u64 sizeBytes)
 #endif
 
 static thread_local lava_memvec*  lava_thread_ownedMem = nullptr;       // thread local handle for thread local heap allocations
+static thread_local u64           lava_thread_reclaim  = 0;             // this thread's reclaim slot plus one, which LavaAlloc puts in the top bits of sizeBytes
+static thread_local LavaScratch*   lava_thread_scratch  = nullptr;       // the arena LavaScratchAlloc cuts from, set by LavaLoop - without one the local allocation functions fall back to the thread heap
+static thread_local lava_threadQ*  lava_thread_outQ     = nullptr;       // the output queue of this thread's node calls, so LavaScratchFree can copy outputs out of a block before its bytes are reused
+
+struct alignas(64) LavaReclaimSlot
+{
+  using  abool = std::atomic<bool>;
+  using   aptr = std::atomic<void*>;
+
+  abool   inUse;
+  aptr     head;                                                        // lock free stack of LavaAlloc blocks that other threads took to zero references - the refCount word of each block is reused as the next pointer
+  void*    heap;                                                        // Windows only - the heap the slot's LavaAlloc blocks come from, written by the thread that claims the slot
+};
+static const u64 LAVA_RECLAIM_SLOTS = 1024;                             // shared by every LavaFlow in the process since LavaAlloc doesn't know which flow it is called from
+
+inline LavaReclaimSlot*   LavaReclaimSlots()
+{
+  static LavaReclaimSlot slots[LAVA_RECLAIM_SLOTS] = {};
+  return slots;
+}
+inline void*      LavaRefHeapAlloc(u64 slot, size_t sz)                 // a Win32 heap stays with its reclaim slot, so blocks still in flight when a thread gives the slot up are freed into the heap they came from by the next thread to claim it
+{
+#if defined(_WIN32)
+  if(slot){ return HeapAlloc(LavaReclaimSlots()[slot-1].heap, HEAP_NO_SERIALIZE, sz); }
+#endif
+  return LavaHeapAlloc(sz);                                             // LavaSlabHeap blocks know their heap, so any thread can free them
+}
+inline void        LavaRefHeapFree(u64 slot, void* p)                   // only called by the thread holding the slot
+{
+#if defined(_WIN32)
+  if(slot){ HeapFree(LavaReclaimSlots()[slot-1].heap, HEAP_NO_SERIALIZE, p); return; }
+#endif
+  LavaHeapFree(p);
+}
+
+#if !defined(_WIN32)
+static thread_local sigjmp_buf*   lava_thread_fault   = nullptr;        // set while this thread is inside a node call, so the signal handler knows it can jump back out
+static thread_local int           lava_thread_signal  = 0;              // the signal that ended the last node call that faulted
+
+static const int LAVA_FAULT_SIGS[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL };
+
+inline struct sigaction*  LavaFaultPrev()                               // the handlers that were installed before LavaFaultStack's, one for each of LAVA_FAULT_SIGS
+{
+  static struct sigaction prev[4] = {};
+  return prev;
+}
+static void            LavaFaultHandler(int sig, siginfo_t* info, void* ctx)
+{
+  sigjmp_buf* env = lava_thread_fault;
+  if(env){
+    lava_thread_fault  = nullptr;
+    lava_thread_signal = sig;
+    siglongjmp(*env, 1);
+  }
+
+  TO(4,i) if(LAVA_FAULT_SIGS[i]==sig)                                   // not in a node call, so chain to the handler that was there before while this one stays installed for the next node call
+  {
+    struct sigaction const& prev = LavaFaultPrev()[i];
+    if(prev.sa_flags & SA_SIGINFO){
+      if(prev.sa_sigaction){ prev.sa_sigaction(sig, info, ctx); }
+    }else if(prev.sa_handler == SIG_DFL) SECTION(default handling - every one of LAVA_FAULT_SIGS ends the process, so raising it with the default action in place does not return)
+    {
+      struct sigaction dfl = {}, ours;
+      dfl.sa_handler = SIG_DFL;
+      sigemptyset(&dfl.sa_mask);
+      sigaction(sig, &dfl, &ours);
+      raise(sig);
+      sigaction(sig, &ours, nullptr);
+    }else if(prev.sa_handler != SIG_IGN){
+      prev.sa_handler(sig);
+    }
+    return;
+  }
+}
+struct   LavaFaultStack
+{
+// recovers a LavaLoop thread from a signal raised inside a node call where there is no SEH, so the node is marked RUN_ERROR instead of the process going down
+// Design: the handler is installed for the whole process by the first LavaFaultStack, and each LavaLoop thread has one so the handler runs on that thread's sigaltstack - a node that overflowed its stack can still be jumped out of
+// LavaFaultCall arms it with sigsetjmp without saving the signal mask, which only saves registers - the handler is installed with SA_NODEFER so jumping out of it does not leave the signal blocked
+// Whatever the node was in the middle of is abandoned, so a node that faults while holding a lock or inside the allocator can still leave those broken
+
+  void*       m_stk = nullptr;
+  stack_t    m_prev = {};
+
+  LavaFaultStack()
+  {
+    static bool installed = [](){
+      struct sigaction sa = {};
+      sa.sa_sigaction = LavaFaultHandler;
+      sa.sa_flags     = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+      sigemptyset(&sa.sa_mask);
+      TO(4,i){ sigaction(LAVA_FAULT_SIGS[i], &sa, &LavaFaultPrev()[i]); }
+      return true;
+    }();
+    (void)installed;
+
+    size_t sz = std::max<size_t>(SIGSTKSZ, 1<<16);
+    m_stk     = malloc(sz);
+    if(!m_stk){ return; }
+
+    stack_t ss = {};
+    ss.ss_sp    = m_stk;
+    ss.ss_size  = sz;
+    ss.ss_flags = 0;
+    if( sigaltstack(&ss, &m_prev) != 0 ){ free(m_stk); m_stk = nullptr; }
+  }
+  ~LavaFaultStack()
+  {
+    if(!m_stk){ return; }
+    sigaltstack(&m_prev, nullptr);
+    free(m_stk);
+  }
+  LavaFaultStack(LavaFaultStack const&) = delete;
+  void operator=(LavaFaultStack const&) = delete;
+};
+
+template<class FUNC> LavaInst::State LavaFaultCall(FUNC const& f)      // runs f and returns RUN_ERROR instead of crashing if it raises one of LAVA_FAULT_SIGS
+{
+  sigjmp_buf env;
+  if( sigsetjmp(env, 0) != 0 ){
+    printf("\n signal %d in node call \n", lava_thread_signal);
+    return LavaInst::RUN_ERROR;
+  }
+
+  lava_thread_fault = &env;
+  std::atomic_signal_fence(std::memory_order_seq_cst);                  // the handler has to see the jump buffer before the node runs
+  f();
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  lava_thread_fault = nullptr;
+
+  return LavaInst::NORMAL;
+}
+#endif
 
 // function implementations
 BOOL WINAPI DllMain(
@@ -2241,29 +4680,32 @@ void       PrintMemMapError()
 #endif
 }
 
-LavaNode         MemMapFile(fs::path const& pth)
+LavaNode         MemMapFile(fs::path const& pth)                           // maps the file read only with a writable page in front of it, so the last 16 bytes of that page are a LavaMem header and the mapping can be sent in packets without a copy
 {
   using namespace std;
 
   LavaNode retNd;
+  uint64_t* hdr = nullptr;
   SECTION(OS specific memory mapping)
   {
   #ifdef _WIN32      // windows
-    HANDLE createHndl=NULL, openMappingHndl=NULL, createMappingHndl=NULL;
+    HANDLE createHndl=NULL, createMappingHndl=NULL;
     
     str     pthStr = pth.generic_string();
     LPSTR  pthCstr = (char*)pthStr.c_str();
     
     createHndl = CreateFileA(
                         pthCstr, 
-                        //GENERIC_READ, 
-                        GENERIC_READ | GENERIC_WRITE, 
-                        //FILE_SHARE_READ, // | FILE_SHARE_WRITE, 
-                        FILE_SHARE_READ | FILE_SHARE_WRITE, 
+                        GENERIC_READ, 
+                        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,      // the const directory can be written and refreshed while the old version is still mapped
                         NULL, 
                         OPEN_EXISTING, 
                         FILE_ATTRIBUTE_NORMAL,
                         NULL);
+    if(createHndl == INVALID_HANDLE_VALUE){
+      PrintMemMapError();
+      return LavaNodeListEnd;
+    }
 
     LARGE_INTEGER  fsz;
     fsz.QuadPart = 0;
@@ -2271,6 +4713,7 @@ LavaNode         MemMapFile(fs::path const& pth)
     auto fszOk = GetFileSizeEx(createHndl, fszPtr);
     if(fszOk==0){
       PrintMemMapError();
+      CloseHandle(createHndl);
       return LavaNodeListEnd;
     }else
       retNd.fileSize = fszPtr->QuadPart;
@@ -2278,73 +4721,77 @@ LavaNode         MemMapFile(fs::path const& pth)
     createMappingHndl = CreateFileMappingA(
                           createHndl, 
                           NULL,
-                          //PAGE_READONLY, 
-                          PAGE_READWRITE, 
+                          PAGE_READONLY, 
                           0,
                           0,
                           NULL); 
+    CloseHandle(createHndl);                                                // the mapping keeps the file open
+    if(createMappingHndl == NULL){
+      PrintMemMapError();
+      return LavaNodeListEnd;
+    }
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    u64 gran = si.dwAllocationGranularity;
+    TO(16,i)                                                                // find an address range big enough for the header and the view, then put them both in it - another thread can take the range between the release and the mapping, so try again if it does
+    {
+      u8* base = (u8*)VirtualAlloc(NULL, gran + retNd.fileSize, MEM_RESERVE, PAGE_NOACCESS);
+      if(!base){ break; }
+      VirtualFree(base, 0, MEM_RELEASE);
+
+      u8* hdrPg = (u8*)VirtualAlloc(base, gran, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+      if(hdrPg != base){
+        if(hdrPg){ VirtualFree(hdrPg, 0, MEM_RELEASE); }
+        continue;
+      }
 
-    retNd.fileHndl = createMappingHndl;
-    if(retNd.fileHndl != NULL && retNd.fileHndl != INVALID_HANDLE_VALUE)
-    {
-      retNd.filePtr = MapViewOfFile(retNd.fileHndl,   // handle to map object
-        //FILE_MAP_READ, //| FILE_MAP_WRITE, // FILE_MAP_ALL_ACCESS,   // read/write permission
-        FILE_MAP_READ | FILE_MAP_WRITE,        // read/write permission
-        0,
-        0,
-        0);
-    }else{
-      PrintMemMapError();
+      retNd.filePtr = MapViewOfFileEx(createMappingHndl, FILE_MAP_READ, 0, 0, 0, base + gran);
+      if(retNd.filePtr){ hdr = (uint64_t*)(base + gran) - 2; break; }
+
+      VirtualFree(hdrPg, 0, MEM_RELEASE);
     }
+    CloseHandle(createMappingHndl);                                         // the view keeps the mapping alive
 
     if(retNd.filePtr==nullptr)
     { 
       PrintMemMapError();
-      CloseHandle(retNd.fileHndl); 
       return LavaNodeListEnd;
     }
+    retNd.fileHndl = NULL;
 
   #elif defined(__APPLE__) || defined(__MACH__) || defined(__unix__) || defined(__FreeBSD__) || defined(__linux__)  // osx, linux and freebsd
-      sm.owner  = true; // todo: have to figure out how to detect which process is the owner
-
-      sm.fileHndl = open(sm.path, O_RDWR);
-      if(sm.fileHndl == -1)
-      {
-        sm.fileHndl = open(sm.path, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR |S_IRGRP|S_IWGRP | S_IROTH|S_IWOTH ); // O_CREAT | O_SHLOCK ); // | O_NONBLOCK );
-        if(sm.fileHndl == -1){
-          if(error_code){ *error_code = simdb_error::COULD_NOT_OPEN_MAP_FILE; }
-        }
-        else{
-          //flock(sm.fileHndl, LOCK_EX);   // exclusive lock  // LOCK_NB
-        }
-      }else{ sm.owner = false; }
-
-      if(sm.owner){  // todo: still need more concrete race protection?
-        fcntl(sm.fileHndl, F_GETLK, &flock);
-        flock(sm.fileHndl, LOCK_EX);              // exclusive lock  // LOCK_NB
-                                                  //fcntl(sm.fileHndl, F_PREALLOCATE);
-  #if defined(__linux__) 
-  #else 
-        fcntl(sm.fileHndl, F_ALLOCATECONTIG);
-  #endif
-
-        if( ftruncate(sm.fileHndl, sizeBytes)!=0 ){
-          if(error_code){ *error_code = simdb_error::FTRUNCATE_FAILURE; }
-        }
-        if( flock(sm.fileHndl, LOCK_UN)!=0 ){
-          if(error_code){ *error_code = simdb_error::FLOCK_FAILURE; }
-        }
+    str pthStr = pth.generic_string();
+    int     fd = open(pthStr.c_str(), O_RDONLY);
+    if(fd == -1){ return LavaNodeListEnd; }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0){ close(fd); return LavaNodeListEnd; }
+    retNd.fileSize = (uint64_t)st.st_size;
+
+    u64  pg = (u64)sysconf(_SC_PAGESIZE);
+    u8* base = (u8*)mmap(NULL, pg + retNd.fileSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);     // reserve the header page and the file range together, then map the file over the end of it
+    if(base == MAP_FAILED){ close(fd); return LavaNodeListEnd; }
+
+    if(retNd.fileSize > 0){
+      void* view = mmap(base + pg, retNd.fileSize, PROT_READ, MAP_PRIVATE|MAP_FIXED, fd, 0);
+      if(view == MAP_FAILED){
+        munmap(base, pg + retNd.fileSize);
+        close(fd);
+        return LavaNodeListEnd;
       }
+    }
+    close(fd);                                                              // the mapping keeps the file open
 
-      sm.hndlPtr  = mmap(NULL, sizeBytes, PROT_READ|PROT_WRITE, MAP_SHARED , sm.fileHndl, 0); // MAP_PREFAULT_READ  | MAP_NOSYNC
-      close(sm.fileHndl);
-      sm.fileHndl = 0;
-
-      if(sm.hndlPtr==MAP_FAILED){
-        if(error_code){ *error_code = simdb_error::COULD_NOT_MEMORY_MAP_FILE; }
-      }
+    retNd.filePtr  = base + pg;
+    retNd.fileHndl = 0;
+    hdr            = (uint64_t*)(base + pg) - 2;
   #endif
   }
+
+  hdr[0] = 1;                                                               // the reference held by the LavaConst until the const is unloaded or refreshed
+  hdr[1] = retNd.fileSize | (LavaMem::OWNER_CONST << LavaMem::OWNER_SHIFT);
+
   return retNd;
 }
 
@@ -2360,9 +4807,14 @@ auto            GetRootPath() -> std::wstring
 
     path p(rootPath);
     p.remove_filename();
+  #elif defined(__linux__)
+    char    rootPath[4096];
+    ssize_t      len = readlink("/proc/self/exe", rootPath, sizeof(rootPath));
+    path p( len > 0?  str(rootPath, len)  :  str("./") );
+    p.remove_filename();
   #endif
 
-  return p;
+  return p.wstring();
 }
 auto       GetSharedLibPath() -> std::wstring
 {
@@ -2474,7 +4926,7 @@ auto        GetRefreshPaths(LavaFlow const& inout_flow, fs::path const& libPath,
     if(!pth.has_filename()){ continue; }
 
     auto ext = pth.extension().generic_string();                        // ext is extension
-    if(ext==".dll"){                                                    // todo: use liveExt
+    if(ext==libExt){
       str fstr = pth.filename().generic_string();                       // fstr is file string
       if( !regex_match(fstr,lavaRegex) ){ continue; }
     }else{ continue; }
@@ -2506,7 +4958,7 @@ uint64_t    CopyPathsToLive(lava_paths       const& paths)
   uint64_t count = 0;
   for(auto const& p : paths){
     path livepth(p);
-    livepth.replace_extension(".live.dll");
+    livepth.replace_extension(liveExt);
     
     bool doCopy = false;
     if( exists(livepth) ){
@@ -2579,13 +5031,37 @@ uint64_t        RemovePaths(lava_paths       const& paths)
 
   return count;
 }
+lava_handle     LavaLibOpen(str const& path)                                      // null if the library could not be loaded
+{
+  #if defined(_WIN32)
+    return LoadLibraryA(path.c_str());
+  #else
+    return dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);                               // RTLD_NOW so a library with a missing symbol fails here instead of in a flow thread
+  #endif
+}
+void*            LavaLibSym(lava_handle h, const char* name)
+{
+  #if defined(_WIN32)
+    return (void*)GetProcAddress(h, name);
+  #else
+    return dlsym(h, name);
+  #endif
+}
+int            LavaLibClose(lava_handle h)                                        // non-zero on success like FreeLibrary
+{
+  if(!h){ return 0; }
+  #if defined(_WIN32)
+    return FreeLibrary(h);
+  #else
+    return dlclose(h)==0;
+  #endif
+}
 auto               LoadLibs(lava_paths       const& paths) -> lava_hndlvec
 {
   lava_hndlvec hndls(paths.size(), 0);
 
   TO(paths.size(), i){
-    HMODULE lib = LoadLibrary(TEXT(paths[i].c_str()));
-    hndls[i] = lib;
+    hndls[i] = LavaLibOpen(paths[i]);
   }
 
   return hndls;
@@ -2595,8 +5071,7 @@ auto         PathsToHandles(lava_paths       const& paths) -> lava_hndlvec
   lava_hndlvec hndls(paths.size(), 0);
 
   TO(paths.size(), i){
-    HMODULE lib = LoadLibrary(TEXT(paths[i].c_str()));
-    hndls[i] = lib;
+    hndls[i] = LavaLibOpen(paths[i]);
   }
 
   return hndls;
@@ -2610,11 +5085,7 @@ auto               FreeLibs(lava_hndlvec     const& hndls) -> std::vector<int>
   ret.reserve(hndls.size());
   for(auto const& h : hndls)
   {
-    int result = 0;
-    #if defined(_WIN32)
-      result = FreeLibrary(h);
-      ret.push_back(result);
-    #endif
+    ret.push_back( LavaLibClose(h) );
   }
 
   return ret;
@@ -2655,7 +5126,7 @@ auto       GetFlowNodeLists(lava_hndlvec     const& hndls) -> lava_ptrsvec
   {
     auto h = hndls[i];
     if(h){
-      auto  GetLavaFlowNodes = (GetLavaFlowNodes_t)GetProcAddress(h, TEXT("GetLavaNodes") );
+      auto  GetLavaFlowNodes = (GetLavaFlowNodes_t)LavaLibSym(h, "GetLavaNodes");
       if(!GetLavaFlowNodes){ continue; }
 
       LavaNode*     nodeList = GetLavaFlowNodes();
@@ -2674,7 +5145,7 @@ auto     HandlesToNodeLists(lava_hndlvec     const& hndls) -> lava_ptrsvec
   {
     auto h = hndls[i];
     if(h){
-      auto  GetLavaFlowNodes = (GetLavaFlowNodes_t)GetProcAddress(h, TEXT("GetLavaNodes") );
+      auto  GetLavaFlowNodes = (GetLavaFlowNodes_t)LavaLibSym(h, "GetLavaNodes");
       if(!GetLavaFlowNodes){ continue; }
 
       LavaNode*     nodeList = GetLavaFlowNodes();
@@ -2788,8 +5259,6 @@ auto            SwitchNodes(lava_flowNodes   const&   nds, LavaFlow& inout_flow)
       }
     }
   }
- 
-  lock_guard<mutex> flowLck(inout_flow.m_qLck);                 // todo: only locks the queue, which isn't good enough - need to switch the nodes in a manner that will work live - maybe atomically swap the function pointer to null, update the node, then swap the function pointer again
 
   SECTION(delete the old nodes from the names to ptrs map)
   {
@@ -2805,13 +5274,6 @@ auto            SwitchNodes(lava_flowNodes   const&   nds, LavaFlow& inout_flow)
       inout_flow.flow.erase(pth);
     }
   }
-  SECTION(run the old nodes destructors if they have a destructor)
-  {
-    for(auto n : delNds)
-      if(n && n->destructor){
-        n->destructor();
-      }
-  }
   SECTION(insert new nodes into the names to pointers map and the path to nodes multi-map)
   {
     for(auto const& kv : nds)
@@ -2827,6 +5289,25 @@ auto            SwitchNodes(lava_flowNodes   const&   nds, LavaFlow& inout_flow)
       if(nd && nd->constructor){ nd->constructor(); }
     }
   }
+  SECTION(point the graph instances at the new nodes while the flow threads keep running)
+  {
+    LavaGraph::NodeSwaps swaps;
+    for(auto n : delNds){
+      LavaNode* nxt = nullptr;
+      for(auto const& kv : nds){
+        if( n->name && kv.second->name && strcmp(n->name, kv.second->name)==0 ){ nxt = kv.second; break; }
+      }
+      swaps[n] = nxt;
+    }
+    inout_flow.graph.swapNodes(swaps);                           // returns at a point where no flow thread is still inside an old node
+  }
+  SECTION(run the old nodes destructors if they have a destructor)
+  {
+    for(auto n : delNds)
+      if(n && n->destructor){
+        n->destructor();
+      }
+  }
 
   return oldHndls;
 }
@@ -2908,6 +5389,7 @@ bool         CopyAndRefresh(wstr const& srcDir, wstr const& destDir, LavaFlow& i
 LavaInst::State exceptWrapper(FlowFunc f, LavaFlow& lf, LavaParams* lp, LavaFrame* inFrame, lava_threadQ* outArgs) // LavaOut* outArgs)
 {
   LavaInst::State        ret = LavaInst::NORMAL;  // LavaFlow::NONE;
+#if defined(_WIN32)
   uint64_t         winExcept = 0;
   __try{
     f(lp, inFrame, outArgs);
@@ -2915,6 +5397,9 @@ LavaInst::State exceptWrapper(FlowFunc f, LavaFlow& lf, LavaParams* lp, LavaFram
     ret =  LavaInst::RUN_ERROR; 
     printf("\n windows exception code: %llu \n", winExcept);
   }
+#else
+  ret = LavaFaultCall([&](){ f(lp, inFrame, outArgs); });
+#endif
 
   //#ifndef _NDEBUG
   //  TO(outArgs->size(),i){
@@ -2926,6 +5411,40 @@ LavaInst::State exceptWrapper(FlowFunc f, LavaFlow& lf, LavaParams* lp, LavaFram
 
   return ret;
 }
+LavaInst::State   splitWrapper(SplitFunc f, LavaParams* lp, LavaFrame* inFrame, u64* out_items)
+{
+  LavaInst::State        ret = LavaInst::NORMAL;
+#if defined(_WIN32)
+  uint64_t         winExcept = 0;
+  __try{
+    *out_items = f(lp, inFrame);
+  }__except( (winExcept=GetExceptionCode()) || EXCEPTION_EXECUTE_HANDLER ){
+    ret =  LavaInst::RUN_ERROR; 
+    printf("\n windows exception code: %llu \n", winExcept);
+  }
+#else
+  ret = LavaFaultCall([&](){ *out_items = f(lp, inFrame); });
+#endif
+
+  return ret;
+}
+LavaInst::State  gatherWrapper(GatherFunc f, LavaParams* lp, u32 slot, LavaVal const* parts, u64 count, lava_threadQ* outArgs)
+{
+  LavaInst::State        ret = LavaInst::NORMAL;
+#if defined(_WIN32)
+  uint64_t         winExcept = 0;
+  __try{
+    f(lp, slot, parts, count, outArgs);
+  }__except( (winExcept=GetExceptionCode()) || EXCEPTION_EXECUTE_HANDLER ){
+    ret =  LavaInst::RUN_ERROR; 
+    printf("\n windows exception code: %llu \n", winExcept);
+  }
+#else
+  ret = LavaFaultCall([&](){ f(lp, slot, parts, count, outArgs); });
+#endif
+
+  return ret;
+}
 
 }
 
@@ -2941,7 +5460,7 @@ LavaNode*      AddFlowConst(fs::path const& pth, LavaFlow& inout_flow)
   }
 
   str typeStr, nameStr;
-  SECTION(get the type and name from the file path - name.type.const)
+  SECTION(get the type and name from the file path - name.type.const or name.N.type.const for a newer version of the same const)
   {
     auto typePth = pth;
     typePth.replace_extension("");
@@ -2951,19 +5470,43 @@ LavaNode*      AddFlowConst(fs::path const& pth, LavaFlow& inout_flow)
     nameStr = nameStr.substr(0, nameStr.find('.'));
   }
 
+  str        pstr = pth.generic_string();
+  str      oldPth;
+  LavaNode*  oldNd = nullptr;
+  SECTION(find the const already loaded under the same name, which this file replaces)
+  {
+    auto ni = inout_flow.nameToPtr.find(nameStr);
+    if(ni != inout_flow.nameToPtr.end() && ni->second && ni->second->node_type==LavaNode::CONSTANT){
+      oldNd = ni->second;
+      for(auto const& kv : inout_flow.constMem){ if(kv.second.node==oldNd){ oldPth = kv.first; break; } }
+    }
+
+    error_code ec;
+    if(oldPth.size()>0 && oldPth!=pstr && fs::last_write_time(oldPth, ec) > fs::last_write_time(pth, ec)){ return oldNd; }   // an older file that could not be removed while its mapping was still held does not replace a newer one
+  }
+
   LavaNode    mmapNd = MemMapFile(pth);                                             // use the memory mapping from simdb
 
   LavaNode*  nodePtr = nullptr;
-  SECTION(create LavaConst, use the node pointer in the graph and move the LavaConst into the constMem map)
+  SECTION(create LavaConst, point the graph instances of a replaced const at its node and move the LavaConst into the constMem map)
   {
-    str pstr = pth.generic_string();
-
     LavaConst lc(nameStr, typeStr);
     lc.node->filePtr  = mmapNd.filePtr;
     lc.node->fileSize = mmapNd.fileSize;
     lc.node->fileHndl = mmapNd.fileHndl;
     nodePtr = lc.node;
-    inout_flow.constMem[pstr] = move(lc);                                     // have to do this last since it moves the LavaConst and sets the original version to a nullptr - this might overwrite a former LavaCont, which would deallocate its heap memory on deconstruction
+
+    if(oldNd){
+      LavaGraph::NodeSwaps swaps;
+      swaps[oldNd] = nodePtr;
+      inout_flow.graph.swapNodes(swaps);                                      // returns once no flow thread can still be reading the old node or taking a reference on its mapping, so its LavaConst can be destroyed
+      inout_flow.flow.erase(oldPth);
+      inout_flow.constMem.erase(oldPth);                                      // packets still in flight keep the old mapping until the last of them is dropped
+
+      error_code ec;
+      if(oldPth != pstr){ fs::remove(oldPth, ec); }                           // Windows keeps a file with a mapped view, so it can be left behind until the next refresh
+    }
+    inout_flow.constMem[pstr] = move(lc);                                     // have to do this last since it moves the LavaConst and sets the original version to a nullptr
 
     inout_flow.flow.erase(pstr);
     inout_flow.nameToPtr.erase(nameStr);
@@ -2974,11 +5517,64 @@ LavaNode*      AddFlowConst(fs::path const& pth, LavaFlow& inout_flow)
   return nodePtr;
 }
 
+u64         LavaReclaimClaim()                                            // returns the claimed slot plus one, or 0 if every slot is taken, in which case blocks that reach zero on other threads are leaked instead of reclaimed
+{
+  LavaReclaimSlot* slots = LavaReclaimSlots();
+  TO(LAVA_RECLAIM_SLOTS,i){
+    bool prev = false;
+    if( !slots[i].inUse.compare_exchange_strong(prev, true) ){ continue; }
+  #if defined(_WIN32)
+    if(!slots[i].heap){ slots[i].heap = HeapCreate(HEAP_NO_SERIALIZE, 0, 0); }   // never destroyed, since blocks from it can outlive every thread that held the slot
+    if(!slots[i].heap){ slots[i].inUse.store(false); return 0; }
+  #endif
+    return i+1;
+  }
+  return 0;
+}
+void        LavaReclaimDrain(u64 slot)                                    // frees every block other threads have given back to this slot - O(blocks freed)
+{
+  if(slot == 0){ return; }
+
+  void* p = LavaReclaimSlots()[slot-1].head.exchange(nullptr, std::memory_order_acquire);
+  while(p){
+    void* nxt = *((void**)p);
+    LavaRefHeapFree(slot, p);
+    p = nxt;
+  }
+}
+void      LavaReclaimRelease(u64 slot)                                    // blocks still in flight keep going to the slot and are freed by the next thread to claim it
+{
+  if(slot == 0){ return; }
+
+  LavaReclaimDrain(slot);
+  LavaReclaimSlots()[slot-1].inUse.store(false);
+}
+void           LavaMemRelease(LavaMem lm)                                 // called by the thread whose decRef took lm to zero references
+{
+  u64 owner = lm.owner();
+  if(owner == 0){ return; }                                               // not made by LavaAlloc, so whatever made it frees it
+  if(owner == LavaMem::OWNER_CONST){ LavaConstUnmap(lm); return; }
+  if(owner == lava_thread_reclaim){ LavaRefHeapFree(owner, lm.ptr); return; }
+
+  LavaReclaimSlot& rs = LavaReclaimSlots()[owner-1];
+  void* head = rs.head.load(std::memory_order_relaxed);
+  do{
+    *((void**)lm.ptr) = head;
+  }while( !rs.head.compare_exchange_weak(head, lm.ptr, std::memory_order_release, std::memory_order_relaxed) );
+}
+void              LavaMemDrop(u64 dataAddr)                               // drops the reference a packet holds on the memory at dataAddr and releases it if that was the last one
+{
+  if(!dataAddr){ return; }
+
+  LavaMem lm = LavaMem::fromDataAddr(dataAddr);
+  if(lm.decRef() == 1){ LavaMemRelease(lm); }
+}
+
 void*             LavaAlloc(uint64_t sizeBytes)
 {
-  uint64_t* mem = (uint64_t*)LavaHeapAlloc(sizeBytes + sizeof(uint64_t)*2);
-  mem[0]  =  0;              // reference count
-  mem[1]  =  sizeBytes;      // number of bytes of main allocation
+  uint64_t* mem = (uint64_t*)LavaRefHeapAlloc(lava_thread_reclaim, sizeBytes + sizeof(uint64_t)*2);
+  mem[0]  =  1;                                                           // reference count - the allocating thread holds one reference until the end of its loop iteration so the packets it routes can't be freed under it
+  mem[1]  =  sizeBytes | (lava_thread_reclaim << LavaMem::OWNER_SHIFT);   // number of bytes of main allocation and the slot to give it back to
 
   LavaMem lm;
   lm.ptr  =  mem;
@@ -2990,19 +5586,177 @@ void*             LavaAlloc(uint64_t sizeBytes)
 void*           LavaRealloc(void* addr, uint64_t sizeBytes)
 {
   uint64_t* realAddr = (uint64_t*)addr - 2;
-  uint64_t prevSz    = realAddr[1];                                // get the previous sizeBytes so we know how much to copy
-  if(realAddr[0] != 0)
-    realAddr[0]--;                                                 // decrement the previous memory's references since we are no longer going to have it to decrement in the main loop 
+  uint64_t prevSz    = realAddr[1] & LavaMem::SIZE_MASK;           // get the previous sizeBytes so we know how much to copy - the previous allocation is freed at the end of the loop iteration when this thread drops its reference
 
   void*       nxtMem = LavaAlloc(sizeBytes);                       // make a new allocation that is the requested size
-  memcpy(nxtMem, addr, prevSz);                                    // copy from the previous alloction to the new allocation
+  memcpy(nxtMem, addr, prevSz<sizeBytes? prevSz : sizeBytes);      // copy from the previous alloction to the new allocation
   return nxtMem;
 }
 void               LavaFree(void* addr)
 {
   //void* p = (void*)( (u8*)addr - 16 );  // 16 bytes for the reference count and sizeBytes
   void* p = (void*)( (uint64_t*)addr - 2 );
-  LavaHeapFree(p);
+  LavaMem lm;
+  lm.ptr = p;
+  if(lm.owner() == 0){ LavaHeapFree(p); }                                 // made on a thread without a reclaim slot, so it came from that thread's heap
+  else                 LavaMemRelease(lm);                                // frees into its slot's heap, through the slot's stack if another thread holds it
+}
+void*      LavaScratchAlloc(uint64_t sizeBytes)
+{
+  LavaScratch* sc = lava_thread_scratch;
+  return sc?  sc->alloc(sizeBytes)  :  LavaHeapAlloc(sizeBytes);
+}
+void*    LavaScratchReAlloc(void* addr, uint64_t sizeBytes)
+{
+  LavaScratch* sc = lava_thread_scratch;
+  if(sc && (!addr || sc->owns(addr))){ return sc->realloc(addr, sizeBytes); }
+  return LavaHeapReAlloc(addr, sizeBytes);
+}
+u64      LavaScratchPromote(lava_threadQ* outQ)                           // copies outputs that point into this thread's arena to LavaAlloc memory, since the arena is reset before their packets are taken - returns how many were copied
+{
+  LavaScratch* sc = lava_thread_scratch;
+  if(!sc){ return 0; }
+
+  u64 cnt = 0;
+  u64  sz = outQ->size();
+  TO(sz,i){
+    LavaOut o;
+    if( !outQ->pop(o) ){ break; }
+
+    void* p = (void*)o.val.value;
+    if(p && sc->owns(p)){
+      if( sc->isBlock(p) ){
+        u64 bytes = LavaScratch::size(p);
+        void* cpy = LavaAlloc(bytes);
+        memcpy(cpy, p, bytes);
+        o.val.value = (u64)cpy;
+        ++cnt;
+      }else{ o.val.value = 0; }                                           // points inside a block, so there is no telling how much of it to keep - routing skips it and marks the node OUTPUT_ERROR
+    }
+    outQ->push(o);
+  }
+  return cnt;
+}
+void        LavaScratchFree(void* addr)                                   // only the most recent block is given back - the rest are freed at once when the arena is reset
+{
+  LavaScratch* sc = lava_thread_scratch;
+  if(sc && sc->owns(addr)){
+    if(addr == sc->m_last){
+      if(lava_thread_outQ){ LavaScratchPromote(lava_thread_outQ); }    // an output made from the block is copied out before the block can be cut over
+      sc->freeLast(addr);
+    }
+    return;
+  }
+  LavaHeapFree(addr);
+}
+
+bool        LavaSplitPacket(LavaFlow& lf, LavaParams* lp, LavaNode* nd, LavaFrame* frm, LavaPacket const& pckt)       // returns true if the packet was cut into ranges and they were put in the queue in its place
+{
+  if(!nd || !nd->split || pckt.split!=0 || pckt.val.value==0){ return false; }
+  if(LavaNodeLocks::mode(nd) != LavaNode::EXEC_SHARED){ return false; }   // ranges of an exclusive or pinned node would run one at a time anyway, and its packet would be cut before finding out another thread has the node
+  if(pckt.sz_bytes < lf.splitBytes){ return false; }
+
+  u64 ranges = lf.splitRanges?  lf.splitRanges  :  ((LavaFlow::au64*)&lf.m_threadCount)->load();
+  if(ranges < 2){ return false; }
+
+  u64 items = 0;
+  lp->inputs = 1;
+  lp->cycle  = pckt.cycle;
+  lp->id     = LavaId(pckt.dest_node);
+  if( splitWrapper(nd->split, lp, frm, &items) != LavaInst::NORMAL ){ return false; }   // the node runs on the whole packet and reports its own error
+  if(items < 2 || items > 0xFFFFFFFFull){ return false; }                // LavaFramePacket holds a range in 32 bit item indices
+
+  LavaSplit*  sp = new LavaSplit(items, ranges<items? ranges : items);
+  u64        cnt = sp->ranges();                                         // read before the ranges go in the queue, since the thread that finishes the last one deletes the record
+  u64      chunk = sp->chunk;
+  LavaMem    mem = LavaMem::fromDataAddr(pckt.val.value);
+  if(lf.cycles.on()){ lf.cycles.add(pckt.cycle, cnt); }                // the ranges are work of the packet's cycle until each one has run
+  TO(cnt,r)
+  {
+    LavaPacket rp = pckt;
+    rp.rangeStart = r * chunk;
+    rp.rangeEnd   = std::min(items, rp.rangeStart + chunk);
+    rp.split      = (u64)sp;
+    mem.incRef();                                                        // every range holds its own reference to the whole input
+    lf.putPacket(rp);                                                    // the global queue, so that every thread can take a range
+  }
+  mem.decRef();                                                          // the reference of the packet that was split - the ranges hold theirs, so this is never the last one
+
+  return true;
+}
+LavaVal     LavaConcatParts(LavaVal const* parts, u64 count)             // the default gather - the bytes of every part one after the other
+{
+  u64 total = 0;
+  TO(count,i){ total += LavaMem::fromDataAddr(parts[i].value).sizeBytes(); }
+
+  u8* dst = (u8*)LavaAlloc(total);
+  u8*  cp = dst;
+  TO(count,i){
+    LavaMem lm = LavaMem::fromDataAddr(parts[i].value);
+    memcpy(cp, lm.data(), lm.sizeBytes());
+    cp += lm.sizeBytes();
+  }
+
+  LavaVal v;
+  v.type  = LavaArgType::MEMORY;
+  v.value = (u64)dst;
+  return v;
+}
+bool        LavaSplitFinish(LavaParams* lp, LavaNode* nd, LavaPacket const& pckt, LavaInst::State* inout_state, lava_threadQ* outQ)   // keeps the outputs of a range - returns true when this was the last range and outQ holds the gathered outputs to route
+{
+  using namespace std;
+
+  LavaSplit*      sp = (LavaSplit*)pckt.split;
+  LavaSplit::OutVec& part = sp->parts[ sp->rangeIdx(pckt) ];
+
+  LavaOut o;
+  while( outQ->pop(o) ){
+    if(o.val.value == 0){ sp->failed.store(true); continue; }
+    LavaMem::fromDataAddr(o.val.value).incRef();                         // keeps the output past the end of this iteration, when this thread drops the reference it was allocated with
+    part.push_back(o);
+  }
+  if(*inout_state != LavaInst::NORMAL){ sp->failed.store(true); }
+
+  if(sp->remaining.fetch_sub(1) != 1){ return false; }                   // other ranges are still running
+
+  SECTION(gather the outputs of every range for each output slot in range order)
+  {
+    if(!sp->failed.load())
+    {
+      vector<u32> slots;
+      for(auto const& pt : sp->parts) for(auto const& po : pt){ slots.push_back(po.key.slot); }
+      sort(ALL(slots));
+      slots.erase( unique(ALL(slots)), slots.end() );
+
+      vector<LavaVal> vals;
+      for(u32 slot : slots)
+      {
+        vals.clear();
+        for(auto const& pt : sp->parts) for(auto const& po : pt){ if(po.key.slot==slot){ vals.push_back(po.val); } }
+
+        if(nd && nd->gather){
+          *inout_state = gatherWrapper(nd->gather, lp, slot, vals.data(), vals.size(), outQ);
+          if(*inout_state != LavaInst::NORMAL){ outQ->clear(); break; }
+          LavaScratchPromote(outQ);
+        }else{
+          LavaOut go;
+          go.val      = LavaConcatParts(vals.data(), vals.size());
+          go.key.slot = slot;
+          outQ->push(go);
+        }
+      }
+    }
+  }
+  SECTION(drop the references the record held on the range outputs and delete it)
+  {
+    for(auto const& pt : sp->parts) for(auto const& po : pt){
+      LavaMem lm = LavaMem::fromDataAddr(po.val.value);
+      if(lm.decRef() == 1){ LavaMemRelease(lm); }
+    }
+    delete sp;
+  }
+
+  return true;
 }
 
 void               LavaInit()
@@ -3024,9 +5778,20 @@ bool        RefreshFlowLibs(LavaFlow& inout_flow, bool force=false)
   //}
   //if(!newlibs){ return false; } // avoid doing anything including locking if there no new libraries
 
+  SECTION(only walk the shared library directory after it changed)
+  {
+    str libDir = path( GetSharedLibPath() ).generic_string();
+    if(!inout_flow.libWatch.watching() || inout_flow.libWatch.dir != libDir){ inout_flow.libWatch.watch(libDir); }
+
+    bool changed = inout_flow.libWatch.changed();                      // read even when forced so the events this refresh picks up are not seen again on the next call
+    if(!force && !changed){ return false; }
+  }
+
   bool newlibs  =  false;
   newlibs      |=  CopyAndRefresh(GetSharedLibPath(), GetLiveTmpPath(), inout_flow, false, force);    // try to copy libs to the live_tmp directory, load them, replace the old libraries, then keep the original shared libs
   newlibs      |=  CopyAndRefresh(GetLiveTmpPath(),   GetLivePath(),    inout_flow, true,  force);    // same as above, but wipe out the old paths
+
+  if( GetRefreshPaths(inout_flow, path(GetSharedLibPath())).size() == 0 ){ inout_flow.libWatch.done(); }   // a library that failed to copy or load is still newer than its live version, so the change stays pending and the next call tries it again
   //auto            copyCount = CopyPathsTo(origPaths, GetLiveTmpPath() );
   //auto             tmpPaths = GetRefreshPaths( path(GetLiveTmpPath()), force);
   //lava_flowNodes tmpHndlNds = LoadPaths(tmpPaths);
@@ -3132,20 +5897,201 @@ bool      RefreshFlowConsts(LavaFlow& inout_flow)
   return anyLoaded;
 }
 
+void     LavaProfilePublish(LavaFlow& lf)
+{
+  using namespace std;
+
+  LavaProfiler& prof = lf.profiler;
+  if(!prof.db){ return; }
+
+  vector< pair<u64,LavaNodeProf*> > profs;
+  SECTION(copy the node pointers out so the lock is not held while making the tbl)
+  {
+    lock_guard<mutex> lck(prof.m_lck);
+    profs.reserve( prof.m_nodes.size() );
+    for(auto const& kv : prof.m_nodes){ profs.push_back({kv.first, kv.second.get()}); }
+  }
+
+  tbl          root;
+  vector<tbl> nodes( profs.size() );                                   // the child tbls need to stay alive until the root is flattened
+  root("nodes")       =  (u64)profs.size();
+  root("time ns")     =  LavaProfiler::nowNs();
+  TO(profs.size(),i)
+  {
+    LavaNodeProf const& np = *profs[i].second;
+    tbl&                 t = nodes[i];
+    t("id")            =  profs[i].first;
+    t("calls")         =  np.calls.load();
+    t("errors")        =  np.errors.load();
+    t("time mean")     =  np.time.mean();
+    t("time p50")      =  np.time.percentile(0.5);
+    t("time p90")      =  np.time.percentile(0.9);
+    t("time p99")      =  np.time.percentile(0.99);
+    t("time p999")     =  np.time.percentile(0.999);
+    t("time max")      =  np.time.max();
+    t("wait mean")     =  np.wait.mean();
+    t("wait p50")      =  np.wait.percentile(0.5);
+    t("wait p99")      =  np.wait.percentile(0.99);
+    t("wait max")      =  np.wait.max();
+    t("bytes total")   =  np.bytes.sum.load();
+    t("bytes p50")     =  np.bytes.percentile(0.5);
+    t("bytes p99")     =  np.bytes.percentile(0.99);
+    t("bytes max")     =  np.bytes.max();
+
+    LavaInst li = ((LavaGraph const&)lf.graph).node(profs[i].first);
+    str  label  = toString(profs[i].first, " ", li.node&&li.node->name? li.node->name : "");
+    if(label.size() > sizeof(tbl::KV::Key)-1){ label.resize( sizeof(tbl::KV::Key)-1 ); }
+    root(label.c_str()) = &t;
+  }
+
+  vector<LavaEdgeStat*> stats;
+  if(lf.edges.counting()){
+    TO(lf.edges.m_slots,i){ if(lf.edges.m_stats[i].key.load()){ stats.push_back( &lf.edges.m_stats[i] ); } }
+  }
+  vector<tbl> edges( stats.size() );
+  root("edges")       =  (u64)stats.size();
+  TO(stats.size(),i)
+  {
+    LavaEdgeStat const& es = *stats[i];
+    LavaId            dest;
+    dest.asInt             = es.key.load();
+    tbl&                 t = edges[i];
+    t("node")          =  (u64)dest.nid;
+    t("slot")          =  (u64)dest.sidx;
+    t("packets")       =  es.packets.load();
+    t("bytes")         =  es.bytes.load();
+    t("peak packets")  =  es.peakPackets.load();
+    t("peak bytes")    =  es.peakBytes.load();
+    t("skips")         =  es.skips.load();
+
+    str label = toString("edge ", (u64)dest.nid, ":", (u64)dest.sidx);
+    root(label.c_str()) = &t;
+  }
+
+  vector< pair<u64,LavaPrioProf*> > prios;
+  SECTION(copy the priority pointers out the same way as the node pointers)
+  {
+    lock_guard<mutex> lck(prof.m_lck);
+    TO(prof.m_prios.size(),i){ if(prof.m_prios[i]){ prios.push_back({i, prof.m_prios[i].get()}); } }
+  }
+  vector<tbl> prioTbls( prios.size() );
+  root("priorities")  =  (u64)prios.size();
+  TO(prios.size(),i)
+  {
+    LavaPrioProf const& pp = *prios[i].second;
+    tbl&                 t = prioTbls[i];
+    t("priority")      =  prios[i].first;
+    t("packets")       =  pp.packets.load();
+    t("wait mean")     =  pp.wait.mean();
+    t("wait p50")      =  pp.wait.percentile(0.5);
+    t("wait p99")      =  pp.wait.percentile(0.99);
+    t("wait p999")     =  pp.wait.percentile(0.999);
+    t("wait max")      =  pp.wait.max();
+    t("deadlines")     =  pp.deadline.load();
+    t("missed")        =  pp.missed.load();
+    t("late p99")      =  pp.late.percentile(0.99);
+    t("late max")      =  pp.late.max();
+
+    str label = toString("priority ", prios[i].first);
+    root(label.c_str()) = &t;
+  }
+  root.flatten();
+
+  prof.db->put(prof.key.data(), (u32)prof.key.size(), root.memStart(), (u32)root.sizeBytes());
+}
+bool          LavaTraceDump(LavaFlow& lf)
+{
+  using namespace std;
+
+  LavaTracer& trc = lf.tracer;
+  FILE* f = fopen(trc.path.c_str(), "w");
+  if(!f){ return false; }
+
+  auto nodeName = [&lf](u64 nid) -> str
+  {
+    LavaInst li = ((LavaGraph const&)lf.graph).node(nid);
+    str name = li.node && li.node->name?  str(li.node->name)  :  toString("node ",nid);
+    for(auto& c : name){ if(c=='"' || c=='\\' || c<' '){ c = '_'; } }
+    return name;
+  };
+
+  lock_guard<mutex> lck(trc.m_lck);
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  bool first = true;
+  for(auto const& bp : trc.m_bufs)
+  {
+    LavaTraceBuf const& b = *bp;
+    if(b.free){ continue; }                                            // no thread of this run has taken it
+    u64 cnt = b.count.load(memory_order_acquire);
+
+    fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%llu,\"args\":{\"name\":\"LavaLoop %llu\"}}",
+      first?"":",\n", (unsigned long long)b.tid, (unsigned long long)b.tid);
+    first = false;
+
+    TO(cnt,i)
+    {
+      LavaTraceEvent const& e = b.evs[i];
+      f64 ts = e.st / 1000.0;                                          // chrome trace timestamps are in microseconds
+      switch(e.type)
+      {
+      case LavaTraceEvent::SPAN:
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"node\",\"ph\":\"X\",\"pid\":0,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"id\":%llu,\"cycle\":%llu}}",
+          nodeName(e.nid).c_str(), (unsigned long long)b.tid, ts, (e.en - e.st)/1000.0, (unsigned long long)e.nid, (unsigned long long)e.cycle);
+        break;
+      case LavaTraceEvent::FLOW_OUT:
+        fprintf(f, ",\n{\"name\":\"packet\",\"cat\":\"packet\",\"ph\":\"s\",\"pid\":0,\"tid\":%llu,\"ts\":%.3f,\"id\":%llu}",
+          (unsigned long long)b.tid, ts, (unsigned long long)e.flow);
+        break;
+      case LavaTraceEvent::FLOW_IN:
+        fprintf(f, ",\n{\"name\":\"packet\",\"cat\":\"packet\",\"ph\":\"f\",\"pid\":0,\"tid\":%llu,\"ts\":%.3f,\"id\":%llu,\"args\":{\"dest\":%llu}}",
+          (unsigned long long)b.tid, ts, (unsigned long long)e.flow, (unsigned long long)e.nid);
+        break;
+      default: break;
+      }
+    }
+    if(b.dropped.load() > 0){
+      fprintf(f, ",\n{\"name\":\"dropped %llu events\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%llu,\"ts\":%.3f}",
+        (unsigned long long)b.dropped.load(), (unsigned long long)b.tid, cnt? b.evs[cnt-1].st/1000.0 : 0.0);
+    }
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+
+  return true;
+}
+void          LavaCycleDrop(LavaFlow& lf)                                // drops the frames of finished cycles that never filled and the references their packets hold
+{
+  for(u64 c : lf.cycles.takeDead()){
+    lf.frames.dropCycle(c, [](LavaFramePacket const& p){ LavaMemDrop(p.val.value); });
+  }
+}
+void        LavaDrainQueues(LavaFlow& lf)                              // drops every queued packet and the reference it holds
+{
+  LavaPacket pckt;
+  while( lf.nxtPacket(&pckt) ){ LavaMemDrop(pckt.val.value); }        // takes the queue lock and takes each urgent packet off m_urgent, so the count stays right while LavaLoop threads are still running
+  for(auto& sq : lf.m_stealQs){
+    while( sq.pop(&pckt) ){ LavaMemDrop(pckt.val.value); }
+  }
+}
+void            LavaQuiesce(LavaFlow& lf)                                // called with m_stopLck held once no thread is left in LavaLoop, since a thread in the middle of an iteration can still be putting packets in a frame or on an edge
+{
+  lf.frames.clear([](LavaFramePacket const& p){ LavaMemDrop(p.val.value); });
+  if(lf.edges.counting()){
+    LavaDrainQueues(lf);                                                   // packets a thread routed after LavaStop drained the queues would otherwise be taken off an edge that was zeroed
+    lf.edges.reset( lf.graph.inSltSz() );
+  }
+}
 void               LavaStop(LavaFlow& lf)
 {
   //outQ.clear();                                                       // this will pop all output packets in a thread safe way so that when it is deconstructed there will be no more packets
 
   lf.m_running.store(false);
-  lf.m_frameQLck.lock();                                               // lock queue mutex        
-    lf.frameQ.clear();
-    while( !lf.q.empty() ){
-      auto& pckt = lf.q.top();
-      auto    lm = LavaMem::fromDataAddr(pckt.val.value);
-      //lm.decRef();
-      lf.q.pop();
-    }
-  lf.m_frameQLck.unlock();                                            // unlock queue mutex
+  lf.m_stopLck.lock();                                                 // more than one thread can call LavaStop through the packet callback
+    LavaDrainQueues(lf);
+    if( ((LavaFlow::au64*)&lf.m_threadCount)->load() == 0 ){ LavaQuiesce(lf); }   // otherwise the last LavaLoop thread to leave does it
+    if(lf.tracer.on){ LavaTraceDump(lf); }
+    lf.capture.close();
+  lf.m_stopLck.unlock();
 }
 void               LavaLoop(LavaFlow& lf) //noexcept
 {
@@ -3153,89 +6099,168 @@ void               LavaLoop(LavaFlow& lf) //noexcept
   using namespace std::chrono;
 
   lf.incThreadCount();
+  u32 thrdIdx = lf.m_sched==LavaFlow::LOCAL_FIRST?  lf.claimStealQ()  :  LAVA_MAX_THREADS;
+  u32  pinIdx = lf.graph.claimPin();
+  u64 nodeTok = lf.nodeLocks.token();                 // identifies this thread to exclusive and pinned nodes
 
   lava_threadQ     outQ;                              // queue of the output arguments
   lava_memvec  ownedMem;
+  LavaScratch   scratch;                              // backs lp.local_alloc for the node calls of one iteration
   LavaFrame     inFrame;
   LavaVal        inArgs[LAVA_ARG_COUNT]={};           // these will end up on the per-thread stack when the thread enters this function, which is what we want - thread specific memory for the function call
   LavaParams         lp = lf.defaultParams;
+  LavaBackoff::Streak idleStreak;
+  LavaPacket   fusedPkt;                              // the output handed straight to the next node of a fused chain, run by this thread on its next iteration
+  bool         hasFused = false;
+  #if !defined(_WIN32)
+    LavaFaultStack faultStk;                          // a node that raises a signal is jumped out of on this thread's signal stack and marked RUN_ERROR
+  #endif
+
+  using ProfCache = unordered_map<u64, LavaNodeProf*>;
+  ProfCache     profCache;                                    // this thread's pointers to the profiler's per node stats so the profiler's lock is only taken the first time a node is seen
+  bool            prof = lf.profiler.on;
+  LavaTraceBuf*    trc = lf.tracer.on?  lf.tracer.threadBuf()  :  nullptr;
+  bool           edges = lf.edges.counting();
+  bool             cap = lf.capture.on();
+  LavaCapture::bytes capBuf;                                  // this thread's buffer for building capture records
+  bool          cycles = lf.cycles.on();
+  auto       nodeProf  = [&lf, &profCache](u64 nid) -> LavaNodeProf*
+  {
+    LavaNodeProf*& np = profCache[nid];
+    if(!np){ np = lf.profiler.node(nid); }
+    return np;
+  };
+  LavaPrioProf* prioCache[256] = {};
+  auto       prioProf  = [&lf, &prioCache](u64 priority) -> LavaPrioProf*
+  {
+    LavaPrioProf*& pp = prioCache[priority & 255];
+    if(!pp){ pp = lf.profiler.prio(priority); }
+    return pp;
+  };
 
   SECTION(initialization at thread start before loop)
   {
     lava_thread_ownedMem = &ownedMem;                   // move the pointer out to a global scope for the thread, so that the allocation function passed to the shared library can add the pointer the owned memory of the thread
+    lava_thread_reclaim  = LavaReclaimClaim();
+    lava_thread_scratch  = &scratch;
+    lava_thread_outQ     = &outQ;
     LavaHeapInit();
 
     if(!lp.ref_alloc)     lp.ref_alloc      =   LavaAlloc;
     if(!lp.ref_realloc)   lp.ref_realloc    =   LavaRealloc;
     if(!lp.ref_free)      lp.ref_free       =   LavaFree;
-    if(!lp.local_alloc)   lp.local_alloc    =   LavaHeapAlloc;
-    if(!lp.local_realloc) lp.local_realloc  =   LavaHeapReAlloc;
-    if(!lp.local_free)    lp.local_free     =   LavaFree;
+    if(!lp.local_alloc)   lp.local_alloc    =   LavaScratchAlloc;
+    if(!lp.local_realloc) lp.local_realloc  =   LavaScratchReAlloc;
+    if(!lp.local_free)    lp.local_free     =   LavaScratchFree;
     if(!lp.lava_puts)     lp.lava_puts      =   puts;
   }
 
   while(lf.m_running)
   {    
+    LavaGraph::ReadGuard graphPin(lf.graph, pinIdx);  // keeps exec() from writing to the graph buffer this iteration reads, including on the continue paths
+    LavaCycles::Hold    cycHold(lf.cycles);           // finishes the packets or generator call this iteration took once their outputs are routed, including on the continue paths
+    LavaNodeLocks::Guard nodeLck(lf.nodeLocks);       // the exclusive node this iteration runs, released as soon as its call returns
     LavaFrame    runFrm;
     LavaPacket     pckt;
     u64          nodeId = LavaId::NODE_NONE;
+    u64           cycle = 0;                          // the cycle of the packet or generator call that runs, which its outputs are part of
     bool         doFlow = false;
+    bool           idle = true;                       // stays true if there was no packet and no generator produced output
+    u64          spanEn = 0;                          // end of the traced node span, which the flow arrows for its output packets start from
     SECTION(make a frame from a packet to run a node or run a generator if no full frames are available)
     {
-      doFlow = lf.nxtPacket(&pckt);
+      if(hasFused){ pckt = fusedPkt; hasFused = false; doFlow = true; }
+      else          doFlow = lf.nxtPacket(&pckt, thrdIdx);
       if(doFlow) SECTION(if there is a packet available, fit it into a existing frame or create a new frame)
       {
-        u16 sIdx  =  pckt.dest_slot;
-        SECTION(lock the frame queue)
+        idle = false;
+        cycle = pckt.cycle;
+        if(cycles){ cycHold.set(cycle, 1); }
+        if(edges){ lf.edges.take(pckt); }
+        if(trc){ trc->put({LavaTraceEvent::FLOW_IN, pckt.dest_node, pckt.cycle, LavaTracer::nowNs(), 0, LavaTracer::flowId(pckt)}); }
+        if(prof){
+          u64 now = LavaProfiler::nowNs();
+          if(pckt.id && now > pckt.id){ nodeProf(pckt.dest_node)->wait.record(now - pckt.id); }
+          prioProf(pckt.priority)->take(now, pckt);
+        }
+
+        u16         sIdx  =  pckt.dest_slot;
+        LavaInst& ndInst  =  lf.graph.node(pckt.dest_node);
+        if(ndInst.inputs > 1) SECTION(put the packet into the frame for its node and cycle and only continue if that filled the frame)
         {
-          lock_guard<mutex> frameQLck(lf.m_frameQLck);                      // need a mutex that automatically unlocks on scope exit so that a goto can be used - the goto is needed to break out of an inner loop
+          LavaFrame* frm = lf.frames.put(pckt, (u16)ndInst.inputs);
+          if(!frm){                                                         // the frame still needs more packets, so go back to the start of the loop
+            if(cycles){ lf.cycles.park(cycle, 1); }
+            continue;
+          }
+
+          if(cycles){ lf.cycles.park(cycle, 1 - (i64)frm->slots); }         // the packets that were waiting run with this one, which is the only one this iteration finishes
+          runFrm = *frm;
+          lf.frames.release(frm);
 
-          bool frameFound = false;
-          SECTION(loop outstanding frames for a match for this packet - determine if a frame was found)
+          if( !lf.nodeLocks.tryRun(ndInst.node, runFrm.dest, nodeTok, &nodeLck) ) SECTION(another thread is running this exclusive node, so put the packets of the frame back in the queue and try a message node instead)
           {
-            TO(lf.frameQ.size(), i)                                       // loop through the current frames looking for one with the same frame number and destination slot id - if no frame is found to put the packet into, make a new one - keep track of the lowest full frame while looping and use that if no full frame is found?
-            {
-              auto& frm = lf.frameQ[i];
-              if(frm.dest  != pckt.dest_node){ continue; }                 // todo: unify dest_node and dest_id etc. as one LavaId LavaPacket
-              if(frm.cycle != pckt.cycle){     continue; }
-
-              bool slotTaken = frm.slotMask[sIdx];
-              if(!slotTaken){
-                //frm.packets[sIdx] = pckt;
-                frm.putSlot(sIdx, pckt);
-                frameFound = true;
-              }
+            TO(LavaFrame::PACKET_SLOTS,i) if(runFrm.slotMask[i]){
+              LavaPacket rp = runFrm.packet(i);
+              if(prof){ rp.id = LavaProfiler::nowNs(); }
+              if(cycles){ lf.cycles.add(rp.cycle, 1); }                    // queued work of their cycle again, in place of what this iteration finishes
+              if(edges){ lf.edges.put(rp); }
+              lf.putPacket(rp);
+            }
+            doFlow = false;
+          }
+        }else SECTION(a node with a single input can run right away with a frame made from just this packet)
+        {
+          runFrm.slots  =  ndInst.inputs;
+          runFrm.dest   =  pckt.dest_node;
+          runFrm.cycle  =  pckt.cycle;
+          runFrm.putSlot(sIdx, pckt);
 
-              if( frm.allFilled() ){                                    // If all the slots are filled, copy the frame out and erase it
-                runFrm = frm;
-                lf.frameQ.erase(lf.frameQ.begin()+i);                   // can't use an index, have to use an iterator for some reason
-                frameFound = true;
-              }
+          if( LavaSplitPacket(lf, &lp, ndInst.node, &runFrm, pckt) ){ continue; }   // a large packet for a splittable node is now ranges in the queue for every thread to run
 
-              if(frameFound){ break; }
-            }
+          if( !lf.nodeLocks.tryRun(ndInst.node, runFrm.dest, nodeTok, &nodeLck) ) SECTION(another thread is running this exclusive node, so put the packet back in the queue before taking a batch for it and try a message node instead)
+          {
+            if(cycles){ lf.cycles.add(pckt.cycle, 1); }
+            if(edges){ lf.edges.put(pckt); }
+            lf.putPacket(pckt);
+            doFlow = false;
           }
-          if(!frameFound) SECTION(if a frame was not found for this packet, create one, then put it in the array if the frame has more than one slot)
+
+          u64 batch = ndInst.node? std::min<u64>(ndInst.node->batch, (u64)LavaFrame::PACKET_SLOTS) : 0;
+          if(doFlow && batch > 1 && pckt.split==0) SECTION(fill the free slots of the frame with more queued packets for this node so the call and its routing are shared)
           {
-            LavaInst& ndInst   =  lf.graph.node(pckt.dest_node);
-            LavaFrame    frm;
-            frm.slots  =  ndInst.inputs;                               // find the number of input slots for the dest node
-            frm.dest   =  pckt.dest_node;
-            frm.cycle  =  pckt.cycle;
-            //runFrm.frame        =  ndInst.fetchIncFrame();
-            frm.putSlot(sIdx, pckt);
-              
-            if(frm.slots > 1){
-              lf.frameQ.push_back(frm);                                // New frame that starts with the current packet put into it 
-              continue;                                                // go back to the start of the loop - jumping out of this scope should unlock the lock_guard mutex above
-            }else
-              runFrm = frm;
+            LavaPacket more[LavaFrame::PACKET_SLOTS];
+            u32 cnt = lf.nxtBatch(pckt, more, (u32)batch-1, thrdIdx);
+            u32   i = 0;
+            if(cycles){ cycHold.set(cycle, 1+cnt); }
+            TO(cnt,b)
+            {
+              while(runFrm.slotMask[i]){ ++i; }
+              runFrm.putSlot(i, more[b]);
+              if(edges){ lf.edges.take(more[b]); }
+
+              if(trc){ trc->put({LavaTraceEvent::FLOW_IN, more[b].dest_node, more[b].cycle, LavaTracer::nowNs(), 0, LavaTracer::flowId(more[b])}); }
+              if(prof){
+                u64 now = LavaProfiler::nowNs();
+                if(more[b].id && now > more[b].id){ nodeProf(pckt.dest_node)->wait.record(now - more[b].id); }
+                prioProf(more[b].priority)->take(now, more[b]);
+              }
+            }
           }
-        } // mutex is unlocked
+        }
 
-        nodeId = runFrm.dest;
-      }else SECTION(try to run a single message node if there was no packet found){
-        nodeId  =  lf.nxtMsgId();
+        if(doFlow){ nodeId = runFrm.dest; }
+        else SECTION(the packets went back in the queue, so nothing of this iteration is left to run with them)
+        {
+          cycHold.release();                                                  // their cycle already counts them as queued again
+          runFrm = LavaFrame();
+          idle   = true;                                                      // backs off like an empty queue unless a message node makes output, so the thread running the busy node gets the core
+        }
+      }
+      if(!doFlow) SECTION(try to run a single message node if there was no packet found or its node was busy)       // a thread that only put packets back would keep the queue from ever looking empty, and generators only run when it is
+      {
+        nodeId  =  lf.nxtMsgId(&cycle, nodeTok, &nodeLck);
+        if(cycles && nodeId!=LavaId::NODE_NONE){ cycHold.set(cycle, 1); }
         // todo: need to work out here if the message node is available - locking and lock free message nodes would come in to play
       }
     }
@@ -3250,12 +6275,14 @@ void               LavaLoop(LavaFlow& lf) //noexcept
         if(func && nodeId!=LavaId::NODE_NONE)
         {
           if(li.node->node_type==LavaNode::CONSTANT){
-            SECTION(copy the memory mapped file in the const node)
-            {              
-              void* outMem = LavaAlloc(li.node->fileSize);
-              memcpy(outMem, li.node->filePtr, li.node->fileSize);
+            if(li.node->filePtr) SECTION(output the memory mapped file in the const node without copying it)       // with nothing mapped there is no output, and the iteration still ends below so its holds are released and the thread stays idle
+            {
+              LavaMem lm = LavaMem::fromDataAddr( (uint64_t)li.node->filePtr );       // AddFlowConst swaps a replaced const out through swapNodes, so the node and its mapping outlive this iteration
+              lm.incRef();                                                       // this iteration holds a reference like it does for its own allocations, so the mapping can not be unmapped while the packets are routed
+              ownedMem.push_back(lm);
+
               LavaOut o;
-              o.val.value = (uint64_t)outMem;
+              o.val.value = (uint64_t)li.node->filePtr;
               o.val.type  = LavaArgType::MEMORY;
               o.key.slot  = 0;
 
@@ -3265,19 +6292,44 @@ void               LavaLoop(LavaFlow& lf) //noexcept
             SECTION(create arguments and call function)
             {
               lp.inputs         =   1;
-              lp.cycle          =   lf.m_cycle;
+              lp.cycle          =   cycle;
               lp.id             =   LavaId(nodeId);
 
+              if(cap && doFlow && lf.capture.has(nodeId)){ lf.capture.put(runFrm, li.node->name, &capBuf); }
+
               auto stTime = high_resolution_clock::now();
                 state       = exceptWrapper(func, lf, &lp, &runFrm, &outQ);         // actually run the node here
+                nodeLck.release();
                 if(state != LavaInst::NORMAL){ outQ.clear(); }
+                else                           LavaScratchPromote(&outQ);
               auto endTime = high_resolution_clock::now();
               duration<u64,nano> diff = (endTime - stTime);
               li.addTime( diff.count() );
+              if(prof){
+                LavaNodeProf* np = nodeProf(nodeId);
+                np->calls.fetch_add(1, memory_order_relaxed);
+                np->time.record( diff.count() );
+                if(state != LavaInst::NORMAL){ np->errors.fetch_add(1, memory_order_relaxed); }
+              }
+              if(trc && (doFlow || outQ.size()>0)){                               // generator calls that make no output are left out so an idle flow does not fill the buffer
+                spanEn = duration_cast<nanoseconds>(endTime.time_since_epoch()).count();
+                u64 spanSt = duration_cast<nanoseconds>(stTime.time_since_epoch()).count();
+                trc->put({LavaTraceEvent::SPAN, nodeId, cycle, spanSt, spanEn, 0});
+              }
             }
           }
-          SECTION(take LavaOut structs from the output queue and put them into packet queue as packets)                 // this section will not be reached if there was an error
+          bool routeOut = true;
+          if(doFlow && pckt.split) SECTION(keep the outputs of a range of a split packet and gather them if this is the last range to finish)
           {
+            routeOut = LavaSplitFinish(&lp, li.node, pckt, &state, &outQ);
+          }
+          if(routeOut) SECTION(take LavaOut structs from the output queue and put them into packet queue as packets)                 // this section will not be reached if there was an error
+          {
+            if(outQ.size() > 0){ idle = false; }
+
+            u64 inPri = doFlow? runFrm.priority : 0;                                     // outputs keep the highest priority and the earliest deadline of the packets they were made from
+            u64  inDl = doFlow? runFrm.deadline : 0;
+
             if(outQ.size()==0){
               LavaControl cntrl  =  lf.packetCallback? lf.packetCallback(nullptr) : LavaControl::GO;                                                 // because this is before putting the memory in the queue, it can't get picked up and used yet, though that may not make a difference, since this thread has to free it anyway
               if(cntrl==LavaControl::STOP) 
@@ -3290,28 +6342,33 @@ void               LavaLoop(LavaFlow& lf) //noexcept
                 SECTION(get the next output value from the queue and continue if there is a problem)
                 {
                   if( !outQ.pop(outArg) ){ continue; }
-                  //if(outArg.val.value == 0){ state = LavaInst::OUTPUT_ERROR; continue; }
-                
-                  if(outArg.val.value==0){
-                    mem.ptr = 0;
-                    state   = LavaInst::OUTPUT_ERROR;
-                  }else{ mem = LavaMem::fromDataAddr(outArg.val.value); }                                      // this will be used to increment the reference count for every packet created
+                  if(outArg.val.value == 0){ state = LavaInst::OUTPUT_ERROR; continue; }       // there is no memory to count references on, so nothing is routed for this output
+
+                  mem = LavaMem::fromDataAddr(outArg.val.value);                                 // this will be used to increment the reference count for every packet created
                 }
 
                 LavaPacket basePkt, pkt;
                 SECTION(create new base packet and initialize the main packet with the base)
                 {
-                  basePkt.cycle       =   lf.m_cycle;            // increment the frame on every major loop through both data and message nodes - how to know when a full cycle has passed? maybe purely by message nodes - only increment frame if data is created through a message node cycle
+                  basePkt.cycle       =   cycle;                 // outputs are part of the cycle of the generator call or packets that made them
                   basePkt.framed      =   false;                 // would this go on the socket?
+                  basePkt.priority    =   std::max<u64>(inPri, std::min<u64>(outArg.priority, 255));
+                  basePkt.deadline    =   inDl;
+                  if(outArg.deadline){
+                    u64 dl = LavaProfiler::nowNs() + outArg.deadline;
+                    if(!inDl || dl<inDl){ basePkt.deadline = dl; }
+                  }
                   basePkt.rangeStart  =   0;
                   basePkt.rangeEnd    =   0;
+                  basePkt.split       =   0;
                   basePkt.src_node    =   nodeId;
                   basePkt.src_slot    =   outArg.key.slot;
-                  basePkt.id          =   0;
+                  basePkt.id          =   prof? LavaProfiler::nowNs() : 0;  // when profiling, the id is the time the packet was made so the wait until it is taken out of the queue can be measured
                   basePkt.val         =   outArg.val;
                   basePkt.sz_bytes    =   mem.ptr? mem.sizeBytes() : 0;
                   pkt                 =   basePkt;
                 }
+                if(prof){ nodeProf(nodeId)->bytes.record(basePkt.sz_bytes); }
                 LavaControl cntrl = lf.packetCallback? lf.packetCallback(&pkt) : LavaControl::GO;                                                 // because this is before putting the memory in the queue, it can't get picked up and used yet, though that may not make a difference, since this thread has to free it anyway
               
                 if(cntrl==LavaControl::GO) 
@@ -3319,19 +6376,25 @@ void               LavaLoop(LavaFlow& lf) //noexcept
                 {
                   // route the packet using the graph - the packet may be copied multiple times and go to multiple destination slots
                   LavaId     src  =  { nodeId, outArg.key.slot, false };
-                  auto        di  =  lf.graph.destCncts(src);                         // di is destination iterator
-                  auto     diCnt  =  di;                                              // diCnt is destination iterator counter - used to count the number of destination slots this packet will be copied to so that the reference count can be set correctly
-                  auto      diEn  =  lf.graph.destCnctEnd();
-                  for(; di!=diEn && di->first==src; ++di)
+                  auto        di  =  lf.graph.routes().find(src);                     // di is destination range - first and second are pointers into the flat routing table
+                  LavaId    fuse  =  lf.graph.fusedDest(nodeId);
+                  bool     local  =  true;
+                  if(cycles){ lf.cycles.add(cycle, (u64)(di.second - di.first)); }        // counted before any copy is in a queue, so no thread can finish the cycle under this one
+                  for(auto d = di.first; d != di.second; ++d)
                   {                                                                   // loop through the 1 or more destination slots connected to this source
-                    LavaId  pktId = di->second;
+                    LavaId  pktId = *d;
                     pkt           = basePkt;                                          // pkt is packet
                     pkt.dest_node = pktId.nid;
                     pkt.dest_slot = pktId.sidx;
 
                     mem.incRef();
+                    if(edges){ lf.edges.put(pkt); }
+                    if(trc){ trc->put({LavaTraceEvent::FLOW_OUT, nodeId, pkt.cycle, spanEn? spanEn-1 : LavaTracer::nowNs(), 0, LavaTracer::flowId(pkt)}); }   // a flow start binds to the slice around it, so it is put just inside the end of the node's span
 
-                    lf.putPacket(pkt);                                                // putPacket contains a mutex for now, eventually will be a lock free queue
+                    if(!hasFused && pktId==fuse){ fusedPkt = pkt; hasFused = true; }  // the only consumer of this output runs next on this thread without a queue - further outputs to it in the same call go through the queue so other threads can take them
+                    else if(local){ lf.putLocalPacket(pkt, thrdIdx); }                // the first destination stays with this thread while the data is hot in its cache
+                    else            lf.putPacket(pkt);                                // fan out goes to the global queue so that other threads can run the other destinations at the same time
+                    local = false;
                   }
                 }
                 else if(cntrl==LavaControl::STOP)
@@ -3357,40 +6420,62 @@ void               LavaLoop(LavaFlow& lf) //noexcept
           lf.graph.setState(nodeId, LavaInst::RUN_ERROR);                                  // todo: should deal with this at load time and not here of course
         }break;
         case LavaInst::NORMAL:
-        default:{                                                                          // if everything worked, decrement the references of all the packets in the frame
-          if(doFlow){
-            TO(LavaFrame::PACKET_SLOTS,i) if(runFrm.slotMask[i]){
-             
-              LavaMem mem = LavaMem::fromDataAddr(runFrm.packets[i].val.value);
-              mem.decRef();
-            }
-          }
-        }break;
+        default: break;
       }
     }
-    SECTION(dealloction - partition owned allocations and free those with their reference count at 0)
+    if(doFlow) SECTION(decrement the references of all the packets in the frame)                  // whether or not the node worked, since a failed frame is not put back in the queue
+    {
+      TO(LavaFrame::PACKET_SLOTS,i) if(runFrm.slotMask[i]){ LavaMemDrop(runFrm.packets[i].val.value); }
+    }
+    SECTION(dealloction - drop the reference this thread holds to what it allocated this iteration and free what was given back)
     {
       //for(auto const& lm : ownedMem){ PrintLavaMem(lm); }
 
-      auto  zeroRef  =  partition(ALL(ownedMem), [](auto a){return a.refCount() > 0;} );                           // partition the memory with zero references to the end / right of the vector so they can be deleted by just cutting down the size of the vector
-      auto freeIter  =  zeroRef;
-      for(; freeIter != end(ownedMem); ++freeIter){                            // loop through the memory with zero references and free them
-        LavaFree( freeIter->data() );                                          // LavaFree will subtract 16 bytes from the  pointer given to it - ->data() should give the address at the start of the memory meant to be used, then LavaFree will subtract 16 from that
+      for(auto& lm : ownedMem){                                                // allocations that were not put in any packet go to zero here - the rest are freed by whichever thread drops their last reference
+        if(lm.decRef() == 1){ LavaMemRelease(lm); }                            // frees this thread's own allocations and unmaps a const that was unloaded while its packets were in flight
       }
-      ownedMem.erase(zeroRef, end(ownedMem));                                  // erase the now freed memory
+      ownedMem.clear();                                                        // keeps its capacity, so there is no reallocation from one iteration to the next
 
-      if(ownedMem.size() <= ownedMem.capacity()/4 ){
-        ownedMem.shrink_to_fit();
-      }
+      LavaReclaimDrain(lava_thread_reclaim);
+      scratch.reset();                                                         // every output that pointed into it was copied out before it was routed
+    }
+    if(prof && lf.profiler.due()){ LavaProfilePublish(lf); }
+
+    cycHold.release();
+    if(cycles && lf.cycles.hasDead()){ LavaCycleDrop(lf); }
+    graphPin.release();                                                        // an idle thread waiting below should not hold up graph edits
+
+    SECTION(back off when there was nothing to do so idle flows do not keep every core busy)
+    {
+      if(idle) lf.idleWait(idleStreak);
+      else     lf.idleEnd(idleStreak);
     }
   }
 
   SECTION(loop through allocations and wait for their ref counts to be zero before exiting the loop)
   {
     // will the allocations need to be freed here like the normal deallocation loop?
+    if(hasFused) SECTION(the flow stopped before the fused packet ran, so give back the reference and the edge count it was holding)
+    {
+      if(edges){ lf.edges.take(fusedPkt); }
+      if(fusedPkt.val.value){
+        LavaMem lm = LavaMem::fromDataAddr(fusedPkt.val.value);
+        if(lm.decRef() == 1){ LavaMemRelease(lm); }
+      }
+      hasFused = false;
+    }
   }
 
-  lf.decThreadCount();
+  lf.releaseStealQ(thrdIdx);
+  lf.nodeLocks.unpin(nodeTok);
+  lf.graph.releasePin(pinIdx);
+  LavaReclaimRelease(lava_thread_reclaim);
+  lava_thread_reclaim = 0;
+  lava_thread_scratch = nullptr;
+  lava_thread_outQ    = nullptr;
+  lf.m_stopLck.lock();
+    if(lf.decThreadCount()==1 && !lf.m_running){ LavaQuiesce(lf); }
+  lf.m_stopLck.unlock();
 }
 
 // end function implementations
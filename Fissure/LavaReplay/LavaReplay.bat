@@ -0,0 +1,8 @@
+clang++ -fms-compatibility -fms-compatibility-version=19 -fms-extensions -std=c++14  -w  -ferror-limit=10 -O3 LavaReplay.cpp -c -o LavaReplay.o
+clang++ -fms-compatibility -fms-compatibility-version=19 -fms-extensions -std=c++14  -w  -ferror-limit=10 -O3 ../fissure/Jzon.cpp -c -o Jzon.o
+@echo -Compilation Finished-
+
+lld-link.exe /libpath:"C:\\Program Files (x86)\\Microsoft Visual Studio\2017\Community\VC\Tools\MSVC\14.10.25017\lib\x64" /libpath:"C:\\Program Files (x86)\\Windows Kits\\10\\Lib\\10.0.15063.0\\um\\x64"   /libpath:"C:\\Program Files (x86)\\Windows Kits\\10\\Lib\\10.0.15063.0\\ucrt\\x64" /defaultlib:kernel32.lib  /machine:x64 /subsystem:console /out:lava_replay.exe libcmt.lib LavaReplay.o Jzon.o 
+@echo -Link Stage Finished-
+
+@rem usage: lava_replay.exe capture.lcap lava_node.dll [--node name] [--runs n] [--warmup n] [--json path|-]
@@ -0,0 +1,320 @@
+// lava_replay - reruns one node from a shared library on input frames captured from a running flow, so a node can be tuned on real data without a graph
+// Usage: lava_replay capture.lcap lava_node.dll [--node name] [--runs n] [--warmup n] [--json path|-]
+//   capture.lcap  written by a LavaFlow with capture.nodes set, for example by lava_run --capture
+//   --node    the node to run - default is the first node in the capture that the library has
+//   --runs    passes over every captured frame of the node - default is 100
+//   --warmup  passes that are run first and not measured - default is 1
+//   --json    also write the report as JSON, - writes it to stdout after the text
+// Latency is the time of each call of the node function, allocations are the calls the node makes to the LavaParams allocation functions
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include "../../no_rt_util.h"
+#include "../../tbl.hpp"
+#include "../../simdb.hpp"
+
+#define __LAVAFLOW_IMPL__
+#include "../LavaFlow.hpp"
+#include "../fissure/Jzon.h"
+
+namespace {
+
+using  clk  =  std::chrono::high_resolution_clock;
+using au64  =  std::atomic<uint64_t>;
+
+struct   ReplayOpts
+{
+  str         capture;
+  str             lib;
+  str            node;
+  u64            runs = 100;
+  u64          warmup = 1;
+  str            json;                                                   // empty is no JSON, - is stdout
+};
+struct  ReplayFrame
+{
+  LavaFrame        frm;
+  std::vector<u64*> mem;                                                 // the LavaMem blocks of the payloads - header then data, the same layout LavaAlloc makes
+};
+struct  ReplayStats
+{
+  LavaHist        time;                                                  // nanoseconds of each call
+  LavaHist      allocs;                                                  // allocation calls the node made in each call
+  LavaHist  allocBytes;                                                  // bytes the node asked for in each call
+  LavaHist     outputs;                                                  // packets the node output in each call
+  u64           errors = 0;
+  u64       inputBytes = 0;                                              // payload bytes of one pass over the frames
+};
+
+au64   allocCalls;                                                       // counted by the LavaParams allocation functions handed to the node
+au64   allocBytes;
+
+void*    countAlloc(uint64_t sz)             { allocCalls.fetch_add(1); allocBytes.fetch_add(sz); return LavaAlloc(sz);          }
+void*  countRealloc(void* p, uint64_t sz)    { allocCalls.fetch_add(1); allocBytes.fetch_add(sz); return LavaRealloc(p, sz);     }
+void*   countLocal(uint64_t sz)              { allocCalls.fetch_add(1); allocBytes.fetch_add(sz); return LavaScratchAlloc(sz);      }
+void* countLocalRe(void* p, uint64_t sz)     { allocCalls.fetch_add(1); allocBytes.fetch_add(sz); return LavaScratchReAlloc(p, sz); }
+
+bool        parseArgs(int argc, char** argv, ReplayOpts* out)
+{
+  ReplayOpts& o = *out;
+  for(int i=1; i<argc; ++i)
+  {
+    str  a   = argv[i];
+    bool val = i+1 < argc;
+    if(     a=="--node"   && val){ o.node   = argv[++i]; }
+    else if(a=="--runs"   && val){ o.runs   = strtoull(argv[++i], nullptr, 10); }
+    else if(a=="--warmup" && val){ o.warmup = strtoull(argv[++i], nullptr, 10); }
+    else if(a=="--json"   && val){ o.json   = argv[++i]; }
+    else if(a.size()>0 && a[0]!='-' && o.capture.size()==0){ o.capture = a; }
+    else if(a.size()>0 && a[0]!='-' && o.lib.size()==0){     o.lib     = a; }
+    else{ fprintf(stderr, "lava_replay: unknown argument %s \n", a.c_str()); return false; }
+  }
+  if(o.capture.size()==0 || o.lib.size()==0){ fprintf(stderr, "lava_replay: a capture file and a node library are needed \n"); return false; }
+  if(o.runs == 0){ o.runs = 1; }
+  return true;
+}
+auto      readCapture(str const& path, std::vector<str>* out_names) -> std::vector<std::pair<str,ReplayFrame>>     // every frame in the file with the name of the node it was captured from
+{
+  using namespace std;
+
+  vector<pair<str,ReplayFrame>> ret;
+  ifstream f(path, ios::in | ios::binary);
+  if(!f){ fprintf(stderr, "lava_replay: could not open %s \n", path.c_str()); return ret; }
+  str s( (istreambuf_iterator<char>(f)), istreambuf_iterator<char>() );
+
+  auto pad = [](u64 sz){ return (sz + 7) & ~7ull; };
+  u64   at = 0;
+  while(at + sizeof(LavaCaptureRec) <= s.size())
+  {
+    LavaCaptureRec rec;
+    memcpy(&rec, s.data()+at, sizeof(rec));
+    if(rec.magic != LavaCaptureRec::MAGIC){ fprintf(stderr, "lava_replay: %s is cut off or is not a capture file at byte %llu \n", path.c_str(), (unsigned long long)at); break; }
+    at += sizeof(rec);
+    if(at + pad(rec.nameLen) > s.size()){ break; }
+
+    str name(s.data()+at, rec.nameLen);
+    at += pad(rec.nameLen);
+
+    ReplayFrame rf;
+    rf.frm.dest  = rec.nid;
+    rf.frm.cycle = rec.cycle;
+    rf.frm.slots = (u16)rec.slots;
+    bool ok = true;
+    TO(rec.filled,i)
+    {
+      LavaCaptureSlot cs;
+      if(at + sizeof(cs) > s.size()){ ok = false; break; }
+      memcpy(&cs, s.data()+at, sizeof(cs));
+      at += sizeof(cs);
+      if(cs.slot >= LavaFrame::PACKET_SLOTS || at + pad(cs.sizeBytes) > s.size()){ ok = false; break; }
+
+      LavaPacket pkt;
+      memset(&pkt, 0, sizeof(pkt));
+      pkt.cycle      = rec.cycle;
+      pkt.dest_node  = rec.nid;
+      pkt.dest_slot  = cs.dest_slot;
+      pkt.src_node   = cs.src_node;
+      pkt.src_slot   = cs.src_slot;
+      pkt.rangeStart = cs.rangeStart;
+      pkt.rangeEnd   = cs.rangeEnd;
+      pkt.val.type   = cs.type;
+      pkt.val.value  = cs.value;
+      if(cs.type == LavaArgType::MEMORY)
+      {
+        u64* blk = (u64*)malloc( sizeof(u64)*2 + cs.sizeBytes );
+        blk[0]   = 1;                                                    // the reference the replay holds for the whole run - the node never drops it
+        blk[1]   = cs.sizeBytes;                                         // owner 0, memory the flow does not own
+        memcpy(blk+2, s.data()+at, cs.sizeBytes);
+        rf.mem.push_back(blk);
+
+        pkt.val.value = (u64)(blk+2);
+        pkt.sz_bytes  = cs.sizeBytes;
+      }
+      at += pad(cs.sizeBytes);
+      rf.frm.putSlot(cs.slot, pkt);
+    }
+    if(!ok){ for(auto blk : rf.mem){ free(blk); } break; }
+
+    auto& nms = *out_names;
+    if( find(ALL(nms), name) == nms.end() ){ nms.push_back(name); }
+    ret.emplace_back( move(name), move(rf) );
+  }
+
+  return ret;
+}
+LavaNode*    findNode(lava_handle h, str const& name)
+{
+  auto getNodes = (GetLavaFlowNodes_t)LavaLibSym(h, "GetLavaNodes");
+  if(!getNodes){ return nullptr; }
+
+  for(LavaNode* n = getNodes(); n && n->func; ++n){
+    if(n->name && name == n->name){ return n; }
+  }
+  return nullptr;
+}
+void           replay(LavaNode* nd, std::vector<ReplayFrame*> const& frms, ReplayOpts const& o, ReplayStats* out_stats)
+{
+  using namespace std;
+  using namespace std::chrono;
+
+  LavaFlow       lf;                                                     // exceptWrapper takes a flow, nothing in it is used
+  lava_threadQ outQ;
+  lava_memvec  ownedMem;
+  LavaScratch   scratch;
+  lava_thread_ownedMem = &ownedMem;                                      // set up the thread the same way LavaLoop does so LavaAlloc works
+  lava_thread_reclaim  = LavaReclaimClaim();
+  lava_thread_scratch  = &scratch;
+  LavaHeapInit();
+  #if !defined(_WIN32)
+    LavaFaultStack faultStk;
+  #endif
+
+  LavaParams lp;
+  memset(&lp, 0, sizeof(lp));
+  lp.ref_alloc      =   countAlloc;
+  lp.ref_realloc    =   countRealloc;
+  lp.ref_free       =   LavaFree;
+  lp.local_alloc    =   countLocal;
+  lp.local_realloc  =   countLocalRe;
+  lp.local_free     =   LavaScratchFree;
+  lp.lava_puts      =   puts;
+  lp.inputs         =   1;
+
+  if(nd->constructor){ nd->constructor(); }
+
+  ReplayStats& st = *out_stats;
+  for(auto rf : frms){
+    TO(LavaFrame::PACKET_SLOTS,i) if(rf->frm.slotMask[i]){ st.inputBytes += rf->frm.packets[i].sz_bytes; }
+  }
+
+  TO(o.warmup + o.runs, r)
+  {
+    bool measure = r >= o.warmup;
+    for(auto rf : frms)
+    {
+      LavaFrame frm = rf->frm;                                           // a copy, so a node that writes to its frame does not change the next run
+      lp.cycle = frm.cycle;
+      lp.id    = LavaId(frm.dest);
+
+      u64  calls = allocCalls.load();
+      u64  bytes = allocBytes.load();
+      auto stTime = clk::now();
+        LavaInst::State state = exceptWrapper(nd->func, lf, &lp, &frm, &outQ);
+      auto endTime = clk::now();
+
+      if(measure){
+        st.time.record( duration_cast<nanoseconds>(endTime - stTime).count() );
+        st.allocs.record( allocCalls.load() - calls );
+        st.allocBytes.record( allocBytes.load() - bytes );
+        st.outputs.record( outQ.size() );
+        if(state != LavaInst::NORMAL){ ++st.errors; }
+      }
+
+      outQ.clear();                                                      // the outputs are not routed anywhere, so their memory goes back with the rest of what the call allocated
+      for(auto& lm : ownedMem){
+        if(lm.decRef() == 1){ LavaMemRelease(lm); }
+      }
+      ownedMem.clear();
+      LavaReclaimDrain(lava_thread_reclaim);
+      scratch.reset();
+    }
+  }
+
+  if(nd->destructor){ nd->destructor(); }
+  lava_thread_scratch = nullptr;
+}
+void      printReport(str const& name, u64 frames, ReplayStats const& st, ReplayOpts const& o)
+{
+  auto us = [](u64 ns){ return ns / 1000.0; };
+
+  printf("\n %s from %s - %llu frames, %llu runs, %llu input bytes per run \n", name.c_str(), o.capture.c_str(),
+    (unsigned long long)frames, (unsigned long long)o.runs, (unsigned long long)st.inputBytes);
+  printf(" %12s %8s %10s %10s %10s %10s %10s %10s \n", "calls", "errors", "mean us", "p50 us", "p90 us", "p99 us", "p999 us", "max us");
+  printf(" %12llu %8llu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f \n",
+    (unsigned long long)st.time.count(), (unsigned long long)st.errors, st.time.mean()/1000.0,
+    us(st.time.percentile(0.5)), us(st.time.percentile(0.9)), us(st.time.percentile(0.99)), us(st.time.percentile(0.999)), us(st.time.max()));
+  printf(" per call - allocations mean %.2f max %llu, allocated bytes mean %.0f max %llu, outputs mean %.2f \n",
+    st.allocs.mean(), (unsigned long long)st.allocs.max(), st.allocBytes.mean(), (unsigned long long)st.allocBytes.max(), st.outputs.mean());
+}
+bool        writeJson(str const& name, u64 frames, ReplayStats const& st, ReplayOpts const& o)
+{
+  using namespace std;
+
+  Jzon::Node root = Jzon::object();
+  root.add("capture",          o.capture);
+  root.add("lib",              o.lib);
+  root.add("node",             name);
+  root.add("frames",           (unsigned long long)frames);
+  root.add("runs",             (unsigned long long)o.runs);
+  root.add("calls",            (unsigned long long)st.time.count());
+  root.add("errors",           (unsigned long long)st.errors);
+  root.add("meanNs",           st.time.mean());
+  root.add("p50Ns",            (unsigned long long)st.time.percentile(0.5));
+  root.add("p90Ns",            (unsigned long long)st.time.percentile(0.9));
+  root.add("p99Ns",            (unsigned long long)st.time.percentile(0.99));
+  root.add("p999Ns",           (unsigned long long)st.time.percentile(0.999));
+  root.add("maxNs",            (unsigned long long)st.time.max());
+  root.add("allocsPerCall",    st.allocs.mean());
+  root.add("allocBytesPerCall",st.allocBytes.mean());
+  root.add("outputsPerCall",   st.outputs.mean());
+
+  str s;
+  Jzon::Writer w;
+  w.writeString(root, s);
+
+  if(o.json == "-"){ printf("%s\n", s.c_str()); return true; }
+
+  ofstream f(o.json, ios::out | ios::binary);
+  if(!f){ fprintf(stderr, "lava_replay: could not write %s \n", o.json.c_str()); return false; }
+  f << s;
+  return (bool)f;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  using namespace std;
+
+  ReplayOpts o;
+  if( !parseArgs(argc, argv, &o) ){ return 1; }
+
+  vector<str> names;
+  auto frames = readCapture(o.capture, &names);
+  if(frames.size() == 0){ fprintf(stderr, "lava_replay: no frames in %s \n", o.capture.c_str()); return 1; }
+
+  lava_handle h = LavaLibOpen(o.lib);
+  if(!h){ fprintf(stderr, "lava_replay: could not load %s \n", o.lib.c_str()); return 1; }
+
+  LavaNode* nd = nullptr;
+  if(o.node.size() > 0){ nd = findNode(h, o.node); }
+  else for(auto const& n : names){
+    nd = findNode(h, n);
+    if(nd){ o.node = n; break; }
+  }
+  if(!nd){ fprintf(stderr, "lava_replay: %s has no node %s from the capture \n", o.lib.c_str(), o.node.c_str()); return 1; }
+
+  vector<ReplayFrame*> frms;
+  for(auto& kv : frames){ if(kv.first == o.node){ frms.push_back(&kv.second); } }
+  if(frms.size() == 0){ fprintf(stderr, "lava_replay: no frames of %s in %s \n", o.node.c_str(), o.capture.c_str()); return 1; }
+
+  ReplayStats st;
+  replay(nd, frms, o, &st);
+
+  printReport(o.node, frms.size(), st, o);
+  if(o.json.size() > 0 && !writeJson(o.node, frms.size(), st, o)){ return 1; }
+
+  for(auto& kv : frames){ for(auto blk : kv.second.mem){ free(blk); } }
+  LavaLibClose(h);
+
+  return 0;
+}
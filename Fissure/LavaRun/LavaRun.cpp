@@ -0,0 +1,454 @@
+
+// lava_run - runs a graph saved by Fissure without a window, for servers and for tracking throughput between builds
+// Usage: lava_run graph.lava [--libs dir] [--consts dir] [--threads n] [--cycles n] [--seconds t] [--multi] [--local] [--json path|-] [--capture names] [--capture-file path] [--window n] [--order cycle|priority|deadline] [--trace path]
+//   --libs     directory of lava_*.dll node libraries - default is the bin directory next to lava_run
+//   --consts   directory of constant files - default is none
+//   --threads  LavaLoop threads - default is one per hardware thread
+//   --cycles   stop once every generator has run this many times
+//   --seconds  stop after this long - default is 10 if --cycles is not given
+//   --multi    use the MULTI_QUEUE packet queue instead of MUTEX_QUEUE
+//   --local    use LOCAL_FIRST scheduling instead of GLOBAL
+//   --json     also write the report as JSON, - writes it to stdout after the text
+//   --capture  comma separated node names whose input frames are appended to the capture file for lava_replay
+//   --capture-file  default is lava_capture.lcap
+//   --window   cycles that can be in flight at once, 0 turns the window off - default is 4
+//   --order    the order packets are run in - cycle is the default, priority runs higher priority outputs ahead of older cycles, deadline runs the earliest deadline first
+//   --trace    write a timeline of every node call and packet to path as Chrome trace JSON, for chrome://tracing or ui.perfetto.dev
+// packets/sec and bytes/sec count the output packets of every node over the wall time of the run
+// the priority table has the queue wait and missed deadlines of the packets of every priority that was seen
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include "../../no_rt_util.h"
+#include "../../tbl.hpp"
+#include "../../simdb.hpp"
+
+#define __LAVAFLOW_IMPL__
+#include "../LavaFlow.hpp"
+#include "../fissure/Jzon.h"
+
+#if defined(_WIN32)
+  #include <Psapi.h>
+  #pragma comment(lib, "psapi.lib")
+#else
+  #include <sys/resource.h>
+#endif
+
+namespace {
+
+using      clk  =  std::chrono::high_resolution_clock;
+using  thrdvec  =  std::vector<std::thread>;
+
+struct    RunOpts
+{
+  str           graph;
+  str            libs;
+  str          consts;
+  u64         threads = 0;                                               // 0 is one per hardware thread
+  u64          cycles = 0;                                               // 0 is no cycle limit
+  f64         seconds = 0;                                               // 0 is no time limit
+  bool          multi = false;
+  bool          local = false;
+  str            json;                                                   // empty is no JSON, - is stdout
+  str         capture;                                                   // comma separated node names
+  str     captureFile;
+  u64          window = 4;                                               // lava_run only runs generators on its own threads, so the window can be on
+  LavaFlow::Order order = LavaPacketOrder::CYCLE_FIRST;
+  str           trace;                                                   // empty is no trace
+};
+struct   PrioStat
+{
+  u64        priority;
+  u64         packets;
+  f64          meanNs;                                                   // queue wait
+  u64           p50Ns;
+  u64           p99Ns;
+  u64           maxNs;
+  u64       deadlines;                                                   // packets that had a deadline
+  u64          missed;
+  u64       lateP99Ns;                                                   // how far past their deadline the missed packets were taken
+};
+struct   NodeStat
+{
+  u64              id;
+  str            name;
+  u64           calls;
+  u64          errors;
+  u64          timeNs;                                                   // total time spent in the node function
+  f64          meanNs;
+  u64           p99Ns;
+  u64         packets;                                                   // packets the node output
+  u64           bytes;                                                   // bytes of the packets the node output
+};
+
+bool        parseArgs(int argc, char** argv, RunOpts* out)
+{
+  RunOpts& o = *out;
+  for(int i=1; i<argc; ++i)
+  {
+    str  a   = argv[i];
+    bool val = i+1 < argc;
+    if(     a=="--libs"    && val){ o.libs    = argv[++i]; }
+    else if(a=="--consts"  && val){ o.consts  = argv[++i]; }
+    else if(a=="--threads" && val){ o.threads = strtoull(argv[++i], nullptr, 10); }
+    else if(a=="--cycles"  && val){ o.cycles  = strtoull(argv[++i], nullptr, 10); }
+    else if(a=="--seconds" && val){ o.seconds = atof(argv[++i]); }
+    else if(a=="--json"    && val){ o.json    = argv[++i]; }
+    else if(a=="--capture" && val){ o.capture = argv[++i]; }
+    else if(a=="--capture-file" && val){ o.captureFile = argv[++i]; }
+    else if(a=="--window"  && val){ o.window  = strtoull(argv[++i], nullptr, 10); }
+    else if(a=="--trace"   && val){ o.trace   = argv[++i]; }
+    else if(a=="--order"   && val){
+      str ord = argv[++i];
+      if(     ord=="cycle")   { o.order = LavaPacketOrder::CYCLE_FIRST;    }
+      else if(ord=="priority"){ o.order = LavaPacketOrder::PRIORITY_FIRST; }
+      else if(ord=="deadline"){ o.order = LavaPacketOrder::DEADLINE_FIRST; }
+      else{ fprintf(stderr, "lava_run: --order is cycle, priority or deadline, not %s \n", ord.c_str()); return false; }
+    }
+    else if(a=="--multi"){          o.multi   = true; }
+    else if(a=="--local"){          o.local   = true; }
+    else if(a.size()>0 && a[0]!='-' && o.graph.size()==0){ o.graph = a; }
+    else{ fprintf(stderr, "lava_run: unknown argument %s \n", a.c_str()); return false; }
+  }
+  if(o.graph.size() == 0){ fprintf(stderr, "lava_run: no graph file given \n"); return false; }
+
+  if(o.threads == 0){ o.threads = std::max<u64>(std::thread::hardware_concurrency(), 1); }
+  if(o.cycles==0 && o.seconds<=0){ o.seconds = 10; }
+  return true;
+}
+u64         loadLibs(LavaFlow& lf, RunOpts const& o)                    // returns the number of node types that were loaded
+{
+  using namespace std;
+  using namespace  fs;
+
+  path libDir = o.libs.size()>0?  path(o.libs)  :  path( GetSharedLibPath() );
+  if( !exists(libDir) ){ fprintf(stderr, "lava_run: library directory %s does not exist \n", libDir.generic_string().c_str()); return 0; }
+
+  lava_paths      paths = GetRefreshPaths(lf, libDir, true);
+  lava_hndlvec    hndls;
+  lava_flowNodes    nds = LoadPaths(paths, hndls);
+  SwitchNodes(nds, lf);
+  TO(paths.size(),i){
+    if(hndls[i]){ lf.libs.insert( {paths[i], hndls[i]} ); }
+  }
+
+  if(o.consts.size() > 0 && exists(path(o.consts))){
+    for(auto& d : directory_iterator(path(o.consts))){ AddFlowConst(d.path(), lf); }
+  }
+
+  return lf.nameToPtr.size();
+}
+bool       loadGraph(LavaFlow& lf, str const& filePath)                 // reads the nodes and connections of a file written by Fissure's saveFile - positions, text and visualized slots are UI state and are skipped
+{
+  using namespace std;
+
+  ifstream f(filePath, ios::in | ios::binary);
+  if(!f){ fprintf(stderr, "lava_run: could not open %s \n", filePath.c_str()); return false; }
+  str s( (istreambuf_iterator<char>(f)), istreambuf_iterator<char>() );
+
+  Jzon::Parser prs;
+  auto graph = prs.parseString(s);
+  if( !graph.isValid() ){ fprintf(stderr, "lava_run: %s is not a graph file \n", filePath.c_str()); return false; }
+
+  auto nd_func  = graph.get("nodes").get("function");
+  auto nd_id    = graph.get("nodes").get("id");
+  auto destId   = graph.get("connections").get("destId");
+  auto destIdx  = graph.get("connections").get("destIdx");
+  auto srcId    = graph.get("connections").get("srcId");
+  auto srcIdx   = graph.get("connections").get("srcIdx");
+
+  LavaGraph& lg = lf.graph;
+  lg.clear();
+
+  u64 mxNdId = 0;
+  TO(nd_id.getCount(),i)
+  {
+    str  funcName = nd_func.get(i).toString();
+    auto       pi = lf.nameToPtr.find(funcName);                        // pi is pointer iterator
+    if(pi == lf.nameToPtr.end() || !pi->second){
+      fprintf(stderr, "lava_run: no loaded library has a node named %s \n", funcName.c_str());
+      return false;
+    }
+
+    LavaNode* ln = pi->second;
+    u64      nid = nd_id.get(i).toInt();
+    mxNdId       = max(mxNdId, nid);
+
+    LavaCommand::Arg A,B;
+    A.ndptr = ln;
+    B.val   = nid;
+    lg.put(LavaCommand::ADD_NODE, A, B);
+
+    LavaCommand::Arg sa;                                                // output slots first so they start at 0, the same as Fissure's node_add
+    for(auto t = ln->out_types; t && *t; ++t){ sa.slotDest = false; lg.put(LavaCommand::ADD_SLOT, sa); }
+    for(auto t = ln->in_types;  t && *t; ++t){ sa.slotDest = true;  lg.put(LavaCommand::ADD_SLOT, sa); }
+  }
+
+  TO(destId.getCount(),i)
+  {
+    LavaCommand::Arg dest, src;
+    src.id   = LavaId( srcId.get(i).toInt(),  srcIdx.get(i).toInt(),  false);
+    dest.id  = LavaId( destId.get(i).toInt(), destIdx.get(i).toInt(), true);
+    lg.put(LavaCommand::TGL_CNCT, dest, src);
+  }
+
+  lg.exec();
+  lg.setNextNodeId(mxNdId + 1);
+  return true;
+}
+u64        setCapture(LavaFlow& lf, RunOpts const& o)                 // returns how many graph nodes will have their inputs captured
+{
+  using namespace std;
+
+  unordered_set<str> names;
+  size_t st = 0;
+  while(st <= o.capture.size()){
+    size_t en = o.capture.find(',', st);
+    if(en == str::npos){ en = o.capture.size(); }
+    if(en > st){ names.insert( o.capture.substr(st, en-st) ); }
+    st = en + 1;
+  }
+
+  for(auto const& li : lf.graph.nodes()){
+    if(li.node && li.node->name && names.count(li.node->name)){ lf.capture.nodes.insert(li.id.nid); }
+  }
+  if(o.captureFile.size() > 0){ lf.capture.path = o.captureFile; }
+
+  return lf.capture.nodes.size();
+}
+u64        peakMemory()                                                 // bytes
+{
+  #if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if( !GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)) ){ return 0; }
+    return (u64)pmc.PeakWorkingSetSize;
+  #else
+    rusage ru;
+    if( getrusage(RUSAGE_SELF, &ru) != 0 ){ return 0; }
+    return (u64)ru.ru_maxrss * 1024;
+  #endif
+}
+bool       cyclesDone(LavaFlow& lf, u64 cycles)                         // a cycle is a call of every generator - with the cycle window on it is also every packet those calls led to
+{
+  if(cycles == 0){ return false; }
+  if(lf.cycles.on()){ return lf.cycles.done() >= cycles; }
+
+  auto const& gens = lf.graph.curMsgCache();
+  if(gens.size() == 0){ return false; }
+  for(auto const& g : gens){
+    if( lf.profiler.node(g.nid)->calls.load() < cycles ){ return false; }
+  }
+  return true;
+}
+auto       nodeStats(LavaFlow& lf) -> std::vector<NodeStat>
+{
+  using namespace std;
+
+  vector<NodeStat> ret;
+  lock_guard<mutex> lck(lf.profiler.m_lck);
+  for(auto const& kv : lf.profiler.m_nodes)
+  {
+    LavaNodeProf const& np = *kv.second;
+    LavaInst            li = ((LavaGraph const&)lf.graph).node(kv.first);
+
+    NodeStat ns;
+    ns.id      = kv.first;
+    ns.name    = li.node && li.node->name?  li.node->name  :  "";
+    ns.calls   = np.calls.load();
+    ns.errors  = np.errors.load();
+    ns.timeNs  = np.time.sum.load();
+    ns.meanNs  = np.time.mean();
+    ns.p99Ns   = np.time.percentile(0.99);
+    ns.packets = np.bytes.count();
+    ns.bytes   = np.bytes.sum.load();
+    ret.push_back(ns);
+  }
+  sort(ALL(ret), [](NodeStat const& a, NodeStat const& b){ return a.id < b.id; });
+  return ret;
+}
+auto       prioStats(LavaFlow& lf) -> std::vector<PrioStat>
+{
+  using namespace std;
+
+  vector<PrioStat> ret;
+  lock_guard<mutex> lck(lf.profiler.m_lck);
+  TO(lf.profiler.m_prios.size(),i)
+  {
+    if(!lf.profiler.m_prios[i]){ continue; }
+    LavaPrioProf const& pp = *lf.profiler.m_prios[i];
+
+    PrioStat ps;
+    ps.priority  = i;
+    ps.packets   = pp.packets.load();
+    ps.meanNs    = pp.wait.mean();
+    ps.p50Ns     = pp.wait.percentile(0.5);
+    ps.p99Ns     = pp.wait.percentile(0.99);
+    ps.maxNs     = pp.wait.max();
+    ps.deadlines = pp.deadline.load();
+    ps.missed    = pp.missed.load();
+    ps.lateP99Ns = pp.late.percentile(0.99);
+    ret.push_back(ps);
+  }
+  return ret;
+}
+void      printReport(std::vector<NodeStat> const& nds, std::vector<PrioStat> const& prs, RunOpts const& o, f64 secs, u64 peakMem, u64 cycles)
+{
+  u64 pkts=0, bytes=0;
+  for(auto const& n : nds){ pkts += n.packets; bytes += n.bytes; }
+
+  printf("\n %s - %llu threads, %.3f seconds \n", o.graph.c_str(), (unsigned long long)o.threads, secs);
+  printf(" %6s %-24s %12s %8s %12s %12s %12s %12s %14s \n", "id", "node", "calls", "errors", "total ms", "mean us", "p99 us", "packets", "bytes");
+  for(auto const& n : nds){
+    printf(" %6llu %-24.24s %12llu %8llu %12.2f %12.2f %12.2f %12llu %14llu \n",
+      (unsigned long long)n.id, n.name.c_str(), (unsigned long long)n.calls, (unsigned long long)n.errors,
+      n.timeNs / 1e6, n.meanNs / 1e3, n.p99Ns / 1e3, (unsigned long long)n.packets, (unsigned long long)n.bytes);
+  }
+  printf("\n packets/sec %.0f   bytes/sec %.0f   peak memory %.1f MB   cycles/sec %.0f \n", pkts/secs, bytes/secs, peakMem / (1024.0*1024.0), cycles/secs);
+
+  printf("\n %8s %12s %12s %12s %12s %12s %12s %10s %12s \n", "priority", "packets", "wait mean us", "wait p50 us", "wait p99 us", "wait max us", "deadlines", "missed", "late p99 us");
+  for(auto const& p : prs){
+    printf(" %8llu %12llu %12.2f %12.2f %12.2f %12.2f %12llu %10llu %12.2f \n",
+      (unsigned long long)p.priority, (unsigned long long)p.packets, p.meanNs / 1e3, p.p50Ns / 1e3, p.p99Ns / 1e3, p.maxNs / 1e3,
+      (unsigned long long)p.deadlines, (unsigned long long)p.missed, p.lateP99Ns / 1e3);
+  }
+}
+bool       writeJson(std::vector<NodeStat> const& nds, std::vector<PrioStat> const& prs, RunOpts const& o, f64 secs, u64 peakMem, u64 cycles)
+{
+  using namespace std;
+
+  u64 pkts=0, bytes=0;
+  Jzon::Node jnodes = Jzon::array();
+  for(auto const& n : nds)
+  {
+    pkts  += n.packets;
+    bytes += n.bytes;
+
+    Jzon::Node jn = Jzon::object();
+    jn.add("id",        (unsigned long long)n.id);
+    jn.add("name",      n.name);
+    jn.add("calls",     (unsigned long long)n.calls);
+    jn.add("errors",    (unsigned long long)n.errors);
+    jn.add("timeNs",    (unsigned long long)n.timeNs);
+    jn.add("meanNs",    n.meanNs);
+    jn.add("p99Ns",     (unsigned long long)n.p99Ns);
+    jn.add("packets",   (unsigned long long)n.packets);
+    jn.add("bytes",     (unsigned long long)n.bytes);
+    jnodes.add(jn);
+  }
+
+  Jzon::Node jprios = Jzon::array();
+  for(auto const& p : prs)
+  {
+    Jzon::Node jp = Jzon::object();
+    jp.add("priority",   (unsigned long long)p.priority);
+    jp.add("packets",    (unsigned long long)p.packets);
+    jp.add("waitMeanNs", p.meanNs);
+    jp.add("waitP50Ns",  (unsigned long long)p.p50Ns);
+    jp.add("waitP99Ns",  (unsigned long long)p.p99Ns);
+    jp.add("waitMaxNs",  (unsigned long long)p.maxNs);
+    jp.add("deadlines",  (unsigned long long)p.deadlines);
+    jp.add("missed",     (unsigned long long)p.missed);
+    jp.add("lateP99Ns",  (unsigned long long)p.lateP99Ns);
+    jprios.add(jp);
+  }
+
+  Jzon::Node root = Jzon::object();
+  root.add("graph",          o.graph);
+  root.add("threads",        (unsigned long long)o.threads);
+  root.add("seconds",        secs);
+  root.add("packetsPerSec",  pkts  / secs);
+  root.add("bytesPerSec",    bytes / secs);
+  root.add("peakMemory",     (unsigned long long)peakMem);
+  root.add("cycles",         (unsigned long long)cycles);
+  root.add("nodes",          jnodes);
+  root.add("priorities",     jprios);
+
+  str s;
+  Jzon::Writer w;
+  w.writeString(root, s);
+
+  if(o.json == "-"){ printf("%s\n", s.c_str()); return true; }
+
+  ofstream f(o.json, ios::out | ios::binary);
+  if(!f){ fprintf(stderr, "lava_run: could not write %s \n", o.json.c_str()); return false; }
+  f << s;
+  return (bool)f;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  using namespace std;
+
+  RunOpts o;
+  if( !parseArgs(argc, argv, &o) ){ return 1; }
+
+  LavaFlow lf(o.multi? LavaFlow::MULTI_QUEUE : LavaFlow::MUTEX_QUEUE, 0, o.local? LavaFlow::LOCAL_FIRST : LavaFlow::GLOBAL, o.order);
+  if( loadLibs(lf, o) == 0 ){ fprintf(stderr, "lava_run: no nodes were loaded \n"); return 1; }
+  if( !loadGraph(lf, o.graph) ){ return 1; }
+  if( o.capture.size() > 0 && setCapture(lf, o) == 0 ){ fprintf(stderr, "lava_run: no node in the graph is named in --capture %s \n", o.capture.c_str()); return 1; }
+
+  SECTION(default lava params for allocators, the same as Fissure sets them)
+  {
+    LavaParams& lp = lf.defaultParams;
+    lp.ref_alloc      =   LavaAlloc;
+    lp.ref_realloc    =   LavaRealloc;
+    lp.ref_free       =   LavaFree;
+    lp.local_alloc    =   LavaScratchAlloc;
+    lp.local_realloc  =   LavaScratchReAlloc;
+    lp.local_free     =   LavaScratchFree;
+    lp.lava_puts      =   puts;
+  }
+  lf.profiler.on = true;                                                // db stays null, so the stats are only recorded for the report
+  lf.cycles.window = o.window;
+  if(o.trace.size() > 0){
+    lf.tracer.on   = true;
+    lf.tracer.path = o.trace;
+  }
+
+  lf.start();
+  thrdvec thrds;
+  auto st = clk::now();
+    TO(o.threads,t){ thrds.emplace_back([&lf](){ LavaLoop(lf); }); }
+    while( lf.m_running.load() )
+    {
+      this_thread::sleep_for( chrono::milliseconds(1) );
+      f64 secs = chrono::duration<f64>(clk::now() - st).count();
+      if( o.seconds > 0 && secs >= o.seconds ){ break; }
+      if( cyclesDone(lf, o.cycles) ){ break; }
+    }
+  auto en = clk::now();
+  lf.stop();
+  for(auto& th : thrds){ th.join(); }
+
+  f64     secs = chrono::duration<f64>(en - st).count();
+  u64  peakMem = peakMemory();
+  auto     nds = nodeStats(lf);
+  auto     prs = prioStats(lf);
+  u64   cycles = lf.cycles.done();                                      // 0 when the window is off, since cycles are not tracked
+  printReport(nds, prs, o, secs, peakMem, cycles);
+  if( lf.capture.on() ){
+    printf("captured %llu frames, %llu bytes to %s - %llu dropped \n", (unsigned long long)lf.capture.m_frames.load(),
+      (unsigned long long)lf.capture.m_bytes.load(), lf.capture.path.c_str(), (unsigned long long)lf.capture.m_dropped.load());
+  }
+  if( lf.tracer.on ){                                                  // lf.stop() does not go through LavaStop, so the timeline is written here
+    if( !LavaTraceDump(lf) ){ fprintf(stderr, "lava_run: could not write %s \n", lf.tracer.path.c_str()); return 1; }
+
+    u64 events = 0, dropped = 0;
+    for(auto const& bp : lf.tracer.m_bufs){ events += bp->count.load(); dropped += bp->dropped.load(); }
+    printf("traced %llu events to %s - %llu dropped \n", (unsigned long long)events, lf.tracer.path.c_str(), (unsigned long long)dropped);
+  }
+  if(o.json.size() > 0 && !writeJson(nds, prs, o, secs, peakMem, cycles)){ return 1; }
+
+  return 0;
+}
@@ -332,6 +332,8 @@ void     stopFlowThreads()
   }
   fd.flowThreads.clear();
   fd.flowThreads.shrink_to_fit();
+  if(fd.flow.tracer.on){ LavaTraceDump(fd.flow); }                 // stopping from the UI doesn't go through LavaStop, so write the timeline here
+  fd.flow.capture.close();
 
   fd.ui.stopBtn->setBackgroundColor(  Color(e3f(.19f, .16f, .17f)) ); 
   fd.ui.stopBtn->setEnabled(false);
@@ -354,14 +356,15 @@ void    startFlowThreads(u64 num=1)
     lp.ref_alloc      =   LavaAlloc;
     lp.ref_realloc    =   LavaRealloc;
     lp.ref_free       =   LavaFree;
-    lp.local_alloc    =   LavaHeapAlloc;
-    lp.local_realloc  =   LavaHeapReAlloc;
-    lp.local_free     =   LavaFree;
+    lp.local_alloc    =   LavaScratchAlloc;
+    lp.local_realloc  =   LavaScratchReAlloc;
+    lp.local_free     =   LavaScratchFree;
     //lp.lava_stdout    =   stdout;
     //lp.lava_stdin     =   stdin;
     //lp.lava_stderr    =   stderr;
     lp.lava_puts      =   puts;
   }
+  fd.flow.profiler.db = &fisdb;                                    // when profiler.on is set, per node stats are published to the "lava profile" key of the Fissure db
 
   fd.flow.start();
 
@@ -1260,7 +1263,7 @@ str           graphToStr(LavaGraph const& lg)
     TO(sz,i){
       assert( lg.curNodes().find( nps[i]->id ) != lg.curNodes().end() );
       LavaInst linst = lg.node(nps[i]->id);
-      nd_func.add( linst.node->name );
+      nd_func.add( linst.node? linst.node->name : "" );                      // null when a reloaded library dropped the node
     }
 
     Jzon::Node    nd_id = Jzon::array();
@@ -2054,7 +2057,11 @@ LavaNode*           sidToConst(LavaId      sid)
   str  type = getSlotType(sid);
   //str   dir = path(GetSharedLibPath()).remove_filename().generic_string();
   str   dir = path( GetConstPath() ).generic_string();
-  str   pth = dir + "/" + key + "." + type + ".const";
+  str   pth;
+  for(u64 gen=0; ; ++gen){                                                // a file name that is not in use, since the file of a const already in the flow is still mapped and packets may be reading it
+    pth = dir + "/" + key + (gen>0? "."+std::to_string(gen) : str("")) + "." + type + ".const";
+    if(!exists(pth)){ break; }
+  }
   bool   ok = writeFile(pth, dat.data(), dat.size());
   if(!ok){ return nullptr; }
   
@@ -2334,14 +2341,11 @@ ENTRY_DECLARATION // main or winmain
           for(auto const& n : nInsts){
             fd.lgrph.setState(n.id.nid, LavaInst::NORMAL);
           }
-          fd.flow.m_qLck.lock();
-            if(fd.flow.q.size() > 0){
-              auto& pckt = fd.flow.q.top();
-              fd.graph.qPacketBytes = 0;
-              fd.graph.qPacketBytes += pckt.sz_bytes;
-              //fd.flow.q.pop();
-            }
-          fd.flow.m_qLck.unlock();
+          LavaPacket pckt;
+          if( fd.flow.peekPacket(&pckt) ){
+            fd.graph.qPacketBytes = 0;
+            fd.graph.qPacketBytes += pckt.sz_bytes;
+          }
           fd.flow.runDestructors(false);
           fd.flow.runConstructors();
         });
@@ -2546,15 +2550,13 @@ ENTRY_DECLARATION // main or winmain
 
             auto& slts = fd.graph.packetSlots;
             slts.clear();
-            fd.flow.m_qLck.lock();
-              if(fd.flow.q.size() > 0){
-                auto& pckt = fd.flow.q.top();
-                fd.graph.qPacketBytes = 0;
-                fd.graph.qPacketBytes += pckt.sz_bytes;
-                slts.emplace( pckt.dest_node, pckt.dest_slot );
-                slts.emplace( pckt.src_node, pckt.src_slot );
-              }
-            fd.flow.m_qLck.unlock();
+            LavaPacket pckt;
+            if( fd.flow.peekPacket(&pckt) ){
+              fd.graph.qPacketBytes = 0;
+              fd.graph.qPacketBytes += pckt.sz_bytes;
+              slts.emplace( pckt.dest_node, pckt.dest_slot );
+              slts.emplace( pckt.src_node, pckt.src_slot );
+            }
           }
           else
           {